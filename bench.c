@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * End-to-end latency of dualsensectl commands against the mock backend.
+ * main.c is included to reach its static functions.
+ */
+
+#define _DEFAULT_SOURCE
+
+#define main dualsensectl_main
+#include "main.c"
+#undef main
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#define DEFAULT_ITERATIONS 500
+
+/* Allocation counting through the glibc internal allocator entry points. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t allocations;
+
+void *malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    allocations++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+/* Counts syscalls of this thread, -1 if the tracepoint is not accessible. */
+static int syscall_counter_open(void)
+{
+    static const char *paths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    };
+    uint64_t id = 0;
+    for (size_t i = 0; i < sizeof(paths) / sizeof(*paths) && !id; ++i) {
+        FILE *f = fopen(paths[i], "r");
+        if (f) {
+            if (fscanf(f, "%" SCNu64, &id) != 1) {
+                id = 0;
+            }
+            fclose(f);
+        }
+    }
+    if (!id) {
+        return -1;
+    }
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = id;
+    attr.sample_period = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+static uint64_t syscall_counter_read(int fd)
+{
+    uint64_t count = 0;
+    if (fd >= 0 && read(fd, &count, sizeof(count)) != sizeof(count)) {
+        count = 0;
+    }
+    return count;
+}
+
+struct bench_case {
+    const char *name;
+    int argc;
+    char *argv[8];
+};
+
+/* Command lines, each run through run_command() with a cold output state. */
+static struct bench_case commands[] = {
+    { "battery", 1, { "battery" } },
+    { "info", 1, { "info" } },
+    { "lightbar on", 2, { "lightbar", "on" } },
+    { "lightbar RGB", 4, { "lightbar", "255", "0", "0" } },
+    { "led-brightness", 2, { "led-brightness", "1" } },
+    { "player-leds", 2, { "player-leds", "3" } },
+    { "microphone", 2, { "microphone", "on" } },
+    { "microphone-led", 2, { "microphone-led", "on" } },
+    { "microphone-mode", 2, { "microphone-mode", "chat" } },
+    { "speaker", 2, { "speaker", "internal" } },
+    { "volume", 2, { "volume", "100" } },
+    { "attenuation", 3, { "attenuation", "3", "3" } },
+    { "trigger feedback", 5, { "trigger", "both", "feedback", "3", "5" } },
+    { "trigger off", 3, { "trigger", "right", "off" } },
+    { "batch", 7, { "lightbar", "0", "0", "255", "+", "player-leds", "1" } },
+};
+
+/* Back to back reports, measures the wait of the default output rate limit. */
+static struct bench_case rate_limited = { "rate limited", 4, { "lightbar", "255", "0", "0" } };
+
+enum bench_op {
+    BENCH_ENUMERATE,
+    BENCH_INIT,
+    BENCH_SEND_OUTPUT_REPORT,
+    BENCH_COMMAND,
+};
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static bool bench_iteration(enum bench_op op, struct dualsense *ds, const char *serial, struct bench_case *c)
+{
+    switch (op) {
+    case BENCH_ENUMERATE:
+        dualsense_free_enumeration(dualsense_transport()->enumerate());
+        return true;
+    case BENCH_INIT: {
+        struct dualsense tmp;
+        if (!dualsense_init(&tmp, serial)) {
+            return false;
+        }
+        dualsense_destroy(&tmp);
+        return true;
+    }
+    case BENCH_SEND_OUTPUT_REPORT: {
+        struct dualsense_output_report rp;
+        uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
+        dualsense_init_output_report(ds, &rp, rbuf);
+        rp.common->valid_flag1 = DS_OUTPUT_VALID_FLAG1_LIGHTBAR_CONTROL_ENABLE;
+        rp.common->lightbar_red = 255;
+        return dualsense_send_output_report(ds, &rp);
+    }
+    case BENCH_COMMAND:
+        memset(&ds->sent, 0, sizeof(ds->sent));
+        return run_command(ds, c->argc, c->argv) == 0;
+    }
+    return false;
+}
+
+static int bench(const char *transport, const char *name, enum bench_op op, struct dualsense *ds,
+                 const char *serial, struct bench_case *c, uint64_t *samples, int iterations, int syscalls_fd)
+{
+    /* Keep command output out of the results */
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    bool ok = true;
+    uint64_t allocs = allocations;
+    uint64_t calls = syscall_counter_read(syscalls_fd);
+    for (int i = 0; i < iterations && ok; ++i) {
+        uint64_t start = monotonic_ns();
+        ok = bench_iteration(op, ds, serial, c);
+        samples[i] = monotonic_ns() - start;
+    }
+    calls = syscall_counter_read(syscalls_fd) - calls;
+    allocs = allocations - allocs;
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    if (!ok) {
+        fprintf(stderr, "%s %s failed\n", transport, name);
+        return 1;
+    }
+
+    qsort(samples, iterations, sizeof(*samples), compare_u64);
+    printf("%-4s %-22s %10.1f %10.1f %8.1f ", transport, name,
+           samples[iterations / 2] / 1000.0, samples[(uint64_t)iterations * 99 / 100] / 1000.0,
+           (double)allocs / iterations);
+    if (syscalls_fd >= 0) {
+        printf("%9.1f\n", (double)calls / iterations);
+    } else {
+        printf("%9s\n", "n/a");
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    if (iterations <= 0) {
+        fprintf(stderr, "Usage: %s [ITERATIONS]\n", argv[0]);
+        return 1;
+    }
+
+    setenv("DUALSENSECTL_BACKEND", "mock", 1);
+    uint64_t *samples = calloc(iterations, sizeof(*samples));
+    int syscalls_fd = syscall_counter_open();
+    int ret = 0;
+
+    printf("%-4s %-22s %10s %10s %8s %9s\n", "", "", "p50 us", "p99 us", "allocs", "syscalls");
+
+    /* The mock backend provides one controller per transport */
+    static const struct {
+        const char *name;
+        const char *serial;
+    } transports[] = {
+        { "usb", "00:11:22:33:44:01" },
+        { "bt", "00:11:22:33:44:02" },
+    };
+
+    for (size_t t = 0; t < sizeof(transports) / sizeof(*transports); ++t) {
+        const char *name = transports[t].name;
+        const char *serial = transports[t].serial;
+        struct dualsense ds;
+        if (!dualsense_init(&ds, serial)) {
+            return 1;
+        }
+
+        /* Measure command cost without the output rate limit, it gets its own case below */
+        uint64_t min_interval = ds.min_interval;
+        ds.min_interval = 0;
+
+        ret |= bench(name, "enumerate", BENCH_ENUMERATE, &ds, serial, NULL, samples, iterations, syscalls_fd);
+        ret |= bench(name, "init", BENCH_INIT, &ds, serial, NULL, samples, iterations, syscalls_fd);
+        ret |= bench(name, "send_output_report", BENCH_SEND_OUTPUT_REPORT, &ds, serial, NULL, samples, iterations, syscalls_fd);
+        for (size_t i = 0; i < sizeof(commands) / sizeof(*commands); ++i) {
+            ret |= bench(name, commands[i].name, BENCH_COMMAND, &ds, serial, &commands[i], samples, iterations, syscalls_fd);
+        }
+        if (min_interval) {
+            ds.min_interval = min_interval;
+            ret |= bench(name, "rate limited", BENCH_COMMAND, &ds, serial, &rate_limited, samples, iterations, syscalls_fd);
+        }
+
+        dualsense_destroy(&ds);
+    }
+
+    if (syscalls_fd >= 0) {
+        close(syscalls_fd);
+    }
+    free(samples);
+    return ret;
+}
@@ -3,8 +3,28 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_PCLMUL
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define CRC32_HAVE_ARMV8
+#endif
+
+/*
+ * All variants operate on the raw CRC state, so the caller is responsible for
+ * the initial 0xFFFFFFFF and the final inversion. crc32_le() picks the fastest
+ * variant supported by the CPU at startup.
+ */
+typedef uint32_t (*crc32_fn)(uint32_t crc, unsigned char const *p, size_t len);
+
 static const uint32_t tab[256] = {
     0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L, 0x706af48fL, 0xe963a535L, 0x9e6495a3L,
     0x0edb8832L, 0x79dcb8a4L, 0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L, 0x90bf1d91L,
@@ -40,7 +60,10 @@ static const uint32_t tab[256] = {
     0xb3667a2eL, 0xc4614ab8L, 0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL, 0x2d02ef8dL,
 };
 
-uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len)
+/* Slicing-by-8 tables, slice_tab[k][n] is CRC of byte n followed by k zero bytes. */
+static uint32_t slice_tab[8][256];
+
+static uint32_t crc32_le_bytewise(uint32_t crc, unsigned char const *p, size_t len)
 {
     while (len--) {
         crc ^= *p++;
@@ -48,3 +71,171 @@ uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len)
     }
     return crc;
 }
+
+static uint32_t crc32_le_slice8(uint32_t crc, unsigned char const *p, size_t len)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = slice_tab[7][lo & 255] ^ slice_tab[6][(lo >> 8) & 255] ^
+              slice_tab[5][(lo >> 16) & 255] ^ slice_tab[4][lo >> 24] ^
+              slice_tab[3][hi & 255] ^ slice_tab[2][(hi >> 8) & 255] ^
+              slice_tab[1][(hi >> 16) & 255] ^ slice_tab[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+#endif
+    return crc32_le_bytewise(crc, p, len);
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+/*
+ * Carry-less multiplication folding as described in Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction" paper,
+ * with the bit-reflected constants for the CRC32 polynomial. Folds 64 bytes
+ * at a time, then 16, then Barrett reduces. The tail below 16 bytes goes
+ * through slicing-by-8.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_le_pclmul(uint32_t crc, unsigned char const *p, size_t len)
+{
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    if (len < 64) {
+        return crc32_le_slice8(crc, p, len);
+    }
+
+    x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    p += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+        p += 64;
+        len -= 64;
+    }
+
+    /* Fold 4 x 128 bits into 128 bits. */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
+        p += 16;
+        len -= 16;
+    }
+
+    /* Fold 128 bits into 64 bits. */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduce to 32 bits. */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    crc = (uint32_t)_mm_extract_epi32(x1, 1);
+
+    return crc32_le_slice8(crc, p, len);
+}
+#endif
+
+#ifdef CRC32_HAVE_ARMV8
+#ifdef __clang__
+__attribute__((target("crc")))
+#else
+__attribute__((target("+crc")))
+#endif
+static uint32_t crc32_le_armv8(uint32_t crc, unsigned char const *p, size_t len)
+{
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32d(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = __crc32b(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static crc32_fn crc32_le_impl = crc32_le_slice8;
+static const char *crc32_le_impl_name = "slice8";
+
+__attribute__((constructor))
+static void crc32_init(void)
+{
+    for (int n = 0; n < 256; ++n) {
+        slice_tab[0][n] = tab[n];
+    }
+    for (int k = 1; k < 8; ++k) {
+        for (int n = 0; n < 256; ++n) {
+            uint32_t c = slice_tab[k - 1][n];
+            slice_tab[k][n] = (c >> 8) ^ tab[c & 255];
+        }
+    }
+
+#ifdef CRC32_HAVE_PCLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        crc32_le_impl = crc32_le_pclmul;
+        crc32_le_impl_name = "pclmul";
+    }
+#endif
+#ifdef CRC32_HAVE_ARMV8
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32_le_impl = crc32_le_armv8;
+        crc32_le_impl_name = "armv8";
+    }
+#endif
+}
+
+static inline uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len)
+{
+    return crc32_le_impl(crc, p, len);
+}
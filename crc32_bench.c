@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#define _XOPEN_SOURCE 700
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc32.h"
+
+#define ITERATIONS 10000000
+
+struct variant {
+    const char *name;
+    crc32_fn fn;
+};
+
+static const struct variant variants[] = {
+    { "bytewise", crc32_le_bytewise },
+    { "slice8", crc32_le_slice8 },
+#ifdef CRC32_HAVE_PCLMUL
+    { "pclmul", crc32_le_pclmul },
+#endif
+#ifdef CRC32_HAVE_ARMV8
+    { "armv8", crc32_le_armv8 },
+#endif
+};
+
+static bool variant_supported(const struct variant *v)
+{
+#ifdef CRC32_HAVE_PCLMUL
+    if (v->fn == crc32_le_pclmul) {
+        return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+    }
+#endif
+#ifdef CRC32_HAVE_ARMV8
+    if (v->fn == crc32_le_armv8) {
+        return getauxval(AT_HWCAP) & HWCAP_CRC32;
+    }
+#endif
+    (void)v;
+    return true;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench(const unsigned char *buf, size_t len)
+{
+    uint32_t expected = crc32_le_bytewise(0xFFFFFFFF, buf, len);
+    volatile uint32_t sink = 0;
+
+    printf("%zu bytes:\n", len);
+    for (size_t i = 0; i < sizeof(variants) / sizeof(*variants); ++i) {
+        const struct variant *v = &variants[i];
+        if (!variant_supported(v)) {
+            printf("  %-10s unsupported\n", v->name);
+            continue;
+        }
+        if (v->fn(0xFFFFFFFF, buf, len) != expected) {
+            fprintf(stderr, "%s: CRC mismatch\n", v->name);
+            return 1;
+        }
+        double start = now();
+        for (int n = 0; n < ITERATIONS; ++n) {
+            sink ^= v->fn(0xFFFFFFFF, buf, len);
+        }
+        double elapsed = now() - start;
+        printf("  %-10s %7.2f ns/op %8.1f MB/s\n", v->name, elapsed * 1e9 / ITERATIONS, len * ITERATIONS / elapsed / 1e6);
+    }
+    (void)sink;
+    return 0;
+}
+
+int main(void)
+{
+    static const unsigned char seeds[] = { 0xA1, 0xA2, 0xA3 };
+    static const uint32_t states[] = { 0x8C2C830C, 0x1525D2B6, 0x6222E220 };
+    for (size_t i = 0; i < sizeof(seeds); ++i) {
+        if (crc32_le_bytewise(0xFFFFFFFF, &seeds[i], 1) != states[i]) {
+            fprintf(stderr, "Seed state mismatch for 0x%02X\n", seeds[i]);
+            return 1;
+        }
+    }
+
+    unsigned char buf[78];
+    srand(0);
+    for (size_t i = 0; i < sizeof(buf); ++i) {
+        buf[i] = rand();
+    }
+
+    printf("Selected: %s\n", crc32_le_impl_name);
+    if (bench(buf, 74) || bench(buf, 78)) {
+        return 1;
+    }
+
+    /* Cross-check all lengths around the fold boundaries. */
+    for (size_t len = 0; len <= sizeof(buf); ++len) {
+        uint32_t expected = crc32_le_bytewise(0x12345678, buf, len);
+        for (size_t i = 0; i < sizeof(variants) / sizeof(*variants); ++i) {
+            if (variant_supported(&variants[i]) && variants[i].fn(0x12345678, buf, len) != expected) {
+                fprintf(stderr, "%s: CRC mismatch at length %zu\n", variants[i].name, len);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
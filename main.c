@@ -5,20 +5,49 @@
  *  Copyright (c) 2020 Sony Interactive Entertainment
  */
 
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 
 #include <unistd.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <poll.h>
+#include <pthread.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sys/wait.h>
 
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
 #include <dbus/dbus.h>
+#ifndef DUALSENSECTL_NO_HIDAPI
 #include <hidapi/hidapi.h>
+#endif
 #include <libudev.h>
 
 #include "crc32.h"
@@ -31,6 +60,10 @@
 #define PS_INPUT_CRC32_SEED 0xA1
 #define PS_OUTPUT_CRC32_SEED 0xA2
 #define PS_FEATURE_CRC32_SEED 0xA3
+/* CRC32 state after hashing each seed byte, i.e. crc32_le(0xFFFFFFFF, &seed, 1). */
+#define PS_INPUT_CRC32_STATE 0x8C2C830C
+#define PS_OUTPUT_CRC32_STATE 0x1525D2B6
+#define PS_FEATURE_CRC32_STATE 0x6222E220
 
 #define DS_INPUT_REPORT_USB 0x01
 #define DS_INPUT_REPORT_USB_SIZE 64
@@ -40,6 +73,8 @@
 #define DS_OUTPUT_REPORT_USB_SIZE 63
 #define DS_OUTPUT_REPORT_BT 0x31
 #define DS_OUTPUT_REPORT_BT_SIZE 78
+#define DS_WRITE_BUCKETS 8
+#define DS_OUTPUT_RATE_BT 250 /* Default limit, higher rates delay input reports */
 
 #define DS_FEATURE_REPORT_CALIBRATION 0x05
 #define DS_FEATURE_REPORT_CALIBRATION_SIZE 41
@@ -254,11 +289,72 @@ struct dualsense_feature_report_firmware {
 };
 _Static_assert(sizeof(struct dualsense_feature_report_firmware) == DS_FEATURE_REPORT_FIRMWARE_INFO_SIZE, "Bad feature report firmware structure size");
 
+/* Device found by enumeration. */
+struct dualsense_device_info {
+    char path[256];
+    char serial[32]; /* MAC address for all known firmwares */
+    uint16_t product_id;
+    bool bt;
+    struct dualsense_device_info *next;
+};
+
+/*
+ * Device access backend, selected with $DUALSENSECTL_BACKEND. Functions follow
+ * hidapi conventions and return byte count, 0 on read timeout or -1 on error.
+ */
+struct dualsense_transport {
+    const char *name;
+    struct dualsense_device_info *(*enumerate)(void);
+    void *(*open)(const struct dualsense_device_info *info);
+    void (*close)(void *dev);
+    int (*write)(void *dev, const uint8_t *data, size_t len);
+    int (*read_timeout)(void *dev, uint8_t *data, size_t len, int timeout);
+    int (*get_feature_report)(void *dev, uint8_t *data, size_t len);
+    const char *(*error)(void *dev); /* dev is NULL for open errors */
+    int (*fd)(void *dev); /* Pollable for input reports, optional */
+    bool cacheable; /* Paths are hidraw nodes, see device_cache_lookup() */
+};
+
 struct dualsense {
     bool bt;
-    hid_device *dev;
+    const struct dualsense_transport *transport;
+    void *dev;
     char mac_address[18];
+    uint16_t product_id;
     uint8_t output_seq;
+    bool failed; /* I/O error, device needs to be reopened */
+    char path[256];
+    FILE *out; /* Command output */
+
+    /*
+     * Shadow copies of the output report. Commands update state and set the
+     * valid flags of the sections they change, see dualsense_flush(). sent
+     * holds the last values sent with the valid flags of all sections known
+     * to the device.
+     */
+    struct dualsense_output_report_common state;
+    struct dualsense_output_report_common sent;
+
+    /*
+     * Output rate limit. Changes flushed earlier than min_interval after the
+     * last report stay pending in state, where later changes overwrite them.
+     */
+    uint64_t min_interval;
+    uint64_t last_output;
+    uint64_t reports_requested;
+    uint64_t reports_sent;
+
+    /* Output write statistics, latency histogram bounds in dualsense_write_buckets */
+    uint64_t write_errors;
+    uint64_t write_latency_sum;
+    uint64_t write_latency[DS_WRITE_BUCKETS + 1];
+
+    /* BT input reports dropped for a CRC mismatch */
+    uint64_t input_crc_errors;
+};
+
+static const uint64_t dualsense_write_buckets[DS_WRITE_BUCKETS] = {
+    50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
 };
 
 static int atoi_x(const char *s)
@@ -302,954 +398,5281 @@ static void dualsense_init_output_report(struct dualsense *ds, struct dualsense_
     }
 }
 
-static void dualsense_send_output_report(struct dualsense *ds, struct dualsense_output_report *report)
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool dualsense_send_output_report(struct dualsense *ds, struct dualsense_output_report *report)
 {
     /* Bluetooth packets need to be signed with a CRC in the last 4 bytes. */
     if (report->bt) {
-        uint32_t crc;
-        uint8_t seed = PS_OUTPUT_CRC32_SEED;
-
-        crc = crc32_le(0xFFFFFFFF, &seed, 1);
-        crc = ~crc32_le(crc, report->data, report->len - 4);
+        report->bt->crc32 = ~crc32_le(PS_OUTPUT_CRC32_STATE, report->data, report->len - 4);
+    }
 
-        report->bt->crc32 = crc;
+    uint64_t start = monotonic_ns();
+    int res = ds->transport->write(ds->dev, report->data, report->len);
+    uint64_t latency = monotonic_ns() - start;
+    int bucket = 0;
+    while (bucket < DS_WRITE_BUCKETS && latency > dualsense_write_buckets[bucket]) {
+        bucket++;
     }
+    ds->write_latency[bucket]++;
+    ds->write_latency_sum += latency;
 
-    int res = hid_write(ds->dev, report->data, report->len);
     if (res < 0) {
-        fprintf(stderr, "Error: %ls\n", hid_error(ds->dev));
+        fprintf(stderr, "Error: %s\n", ds->transport->error(ds->dev));
+        ds->write_errors++;
+        ds->failed = true;
+        return false;
     }
+    return true;
 }
 
-static bool compare_serial(const char *s, const wchar_t *dev)
+/* Maps each valid flag bit to the report fields it controls. */
+struct dualsense_output_section {
+    uint8_t flag; /* Offset of valid_flag0/1/2 */
+    uint8_t bit;
+    uint8_t offset;
+    uint8_t size;
+};
+
+#define DS_OUTPUT_SECTION(flag, bit, first, last) { \
+    offsetof(struct dualsense_output_report_common, flag), bit, \
+    offsetof(struct dualsense_output_report_common, first), \
+    offsetof(struct dualsense_output_report_common, last) + \
+    sizeof(((struct dualsense_output_report_common *)0)->last) - \
+    offsetof(struct dualsense_output_report_common, first) }
+
+static const struct dualsense_output_section dualsense_output_sections[] = {
+    DS_OUTPUT_SECTION(valid_flag0, DS_OUTPUT_VALID_FLAG0_COMPATIBLE_VIBRATION, motor_right, motor_left),
+    DS_OUTPUT_SECTION(valid_flag0, DS_OUTPUT_VALID_FLAG0_HAPTICS_SELECT, motor_right, motor_left),
+    DS_OUTPUT_SECTION(valid_flag0, DS_OUTPUT_VALID_FLAG0_RIGHT_TRIGGER_MOTOR_ENABLE, right_trigger_motor_mode, right_trigger_param),
+    DS_OUTPUT_SECTION(valid_flag0, DS_OUTPUT_VALID_FLAG0_LEFT_TRIGGER_MOTOR_ENABLE, left_trigger_motor_mode, left_trigger_param),
+    DS_OUTPUT_SECTION(valid_flag0, DS_OUTPUT_VALID_FLAG0_HEADPHONE_VOLUME_ENABLE, headphone_audio_volume, headphone_audio_volume),
+    DS_OUTPUT_SECTION(valid_flag0, DS_OUTPUT_VALID_FLAG0_SPEAKER_VOLUME_ENABLE, speaker_audio_volume, speaker_audio_volume),
+    DS_OUTPUT_SECTION(valid_flag0, DS_OUTPUT_VALID_FLAG0_MICROPHONE_VOLUME_ENABLE, internal_microphone_volume, internal_microphone_volume),
+    DS_OUTPUT_SECTION(valid_flag0, DS_OUTPUT_VALID_FLAG0_AUDIO_CONTROL_ENABLE, audio_flags, audio_flags),
+    DS_OUTPUT_SECTION(valid_flag1, DS_OUTPUT_VALID_FLAG1_MIC_MUTE_LED_CONTROL_ENABLE, mute_button_led, mute_button_led),
+    DS_OUTPUT_SECTION(valid_flag1, DS_OUTPUT_VALID_FLAG1_POWER_SAVE_CONTROL_ENABLE, power_save_control, power_save_control),
+    DS_OUTPUT_SECTION(valid_flag1, DS_OUTPUT_VALID_FLAG1_LIGHTBAR_CONTROL_ENABLE, lightbar_red, lightbar_blue),
+    DS_OUTPUT_SECTION(valid_flag1, DS_OUTPUT_VALID_FLAG1_PLAYER_INDICATOR_CONTROL_ENABLE, player_leds, player_leds),
+    DS_OUTPUT_SECTION(valid_flag1, DS_OUTPUT_VALID_FLAG1_VIBRATION_ATTENUATION_ENABLE, reduce_motor_power, reduce_motor_power),
+    DS_OUTPUT_SECTION(valid_flag1, DS_OUTPUT_VALID_FLAG1_AUDIO_CONTROL2_ENABLE, audio_flags2, audio_flags2),
+    DS_OUTPUT_SECTION(valid_flag2, DS_OUTPUT_VALID_FLAG2_LED_BRIGHTNESS_CONTROL_ENABLE, led_brightness, led_brightness),
+    DS_OUTPUT_SECTION(valid_flag2, DS_OUTPUT_VALID_FLAG2_LIGHTBAR_SETUP_CONTROL_ENABLE, lightbar_setup, lightbar_setup),
+    DS_OUTPUT_SECTION(valid_flag2, DS_OUTPUT_VALID_FLAG2_COMPATIBLE_VIBRATION2, motor_right, motor_left),
+};
+
+/* Drops pending changes and restores state to what was last sent. */
+static void dualsense_discard(struct dualsense *ds)
 {
-    if (!s) {
-        return true;
-    }
-    const size_t len = wcslen(dev);
-    if (strlen(s) != len) {
-        return false;
-    }
-    for (size_t i = 0; i < len; ++i) {
-        if (s[i] != dev[i]) {
-            return false;
-        }
-    }
-    return true;
+    ds->state = ds->sent;
+    ds->state.valid_flag0 = 0;
+    ds->state.valid_flag1 = 0;
+    ds->state.valid_flag2 = 0;
 }
 
-static struct hid_device_info *dualsense_hid_enumerate(void)
+/*
+ * Returns the time to record as last_output for a report sent now, after
+ * waiting for the rate limit. Returns 0 if the rate limit does not allow a
+ * report yet and wait is false.
+ */
+static uint64_t dualsense_output_slot(struct dualsense *ds, bool wait)
 {
-    struct hid_device_info *devs;
-    struct hid_device_info **end = &devs;
-    *end = hid_enumerate(DS_VENDOR_ID, DS_PRODUCT_ID);
-    while (*end) {
-        end = &(*end)->next;
+    uint64_t now = monotonic_ns();
+    if (ds->last_output && now < ds->last_output + ds->min_interval) {
+        if (!wait) {
+            return 0;
+        }
+        uint64_t delay = ds->last_output + ds->min_interval - now;
+        struct timespec ts = { delay / 1000000000, delay % 1000000000 };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        }
     }
-    *end = hid_enumerate(DS_VENDOR_ID, DS_EDGE_PRODUCT_ID);
-    return devs;
+    /* Keep the cadence of back to back reports instead of drifting by the send latency */
+    uint64_t next = ds->last_output + ds->min_interval;
+    return ds->last_output && now < next + ds->min_interval ? next : monotonic_ns();
 }
 
-static bool dualsense_init(struct dualsense *ds, const char *serial)
+/*
+ * Sends one output report with all pending sections of the state. Sections
+ * already known to the device with unchanged values are not marked valid, and
+ * nothing is sent if no section changed. If the rate limit does not allow a
+ * report yet, waits for it or leaves the changes pending when wait is false.
+ */
+static bool dualsense_send_pending(struct dualsense *ds, bool wait)
 {
-    bool ret = false;
-
-    memset(ds, 0, sizeof(*ds));
-
-    bool found = false;
-    struct hid_device_info *devs = dualsense_hid_enumerate();
-    struct hid_device_info *dev = devs;
-    while (dev) {
-        if (compare_serial(serial, dev->serial_number)) {
-            found = true;
-            break;
+    uint8_t *state = (uint8_t *)&ds->state;
+    const uint8_t *sent = (const uint8_t *)&ds->sent;
+
+    for (size_t i = 0; i < sizeof(dualsense_output_sections) / sizeof(*dualsense_output_sections); ++i) {
+        const struct dualsense_output_section *s = &dualsense_output_sections[i];
+        if ((state[s->flag] & s->bit) && (sent[s->flag] & s->bit) &&
+            !memcmp(state + s->offset, sent + s->offset, s->size)) {
+            state[s->flag] &= ~s->bit;
         }
-        dev = dev->next;
     }
 
-    if (!found) {
-        if (serial) {
-            fprintf(stderr, "Device '%s' not found\n", serial);
-        } else {
-            fprintf(stderr, "No device found\n");
-        }
-        ret = false;
-        goto out;
+    if (!ds->state.valid_flag0 && !ds->state.valid_flag1 && !ds->state.valid_flag2) {
+        return true;
     }
 
-    ds->dev = hid_open(DS_VENDOR_ID, dev->product_id, dev->serial_number);
-    if (!ds->dev) {
-        fprintf(stderr, "Failed to open device: %ls\n", hid_error(NULL));
-        ret = false;
-        goto out;
+    uint64_t now = dualsense_output_slot(ds, wait);
+    if (!now) {
+        return true;
     }
 
-    wchar_t *serial_number = dev->serial_number;
+    struct dualsense_output_report rp;
+    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
+    dualsense_init_output_report(ds, &rp, rbuf);
+    *rp.common = ds->state;
 
-    if (wcslen(serial_number) != 17) {
-        fprintf(stderr, "Invalid device serial number: %ls\n", serial_number);
-        // Let's just fake serial number as everything except disconnecting will still work
-        serial_number = L"00:00:00:00:00:00";
+    if (!dualsense_send_output_report(ds, &rp)) {
+        dualsense_discard(ds);
+        return false;
     }
 
-    for (int i = 0; i < 18; ++i) {
-        char c = serial_number[i];
-        if (c && (i + 1) % 3) {
-            c = toupper(c);
-        }
-        ds->mac_address[i] = c;
-    }
+    struct dualsense_output_report_common known = ds->sent;
+    ds->sent = ds->state;
+    ds->sent.valid_flag0 |= known.valid_flag0;
+    ds->sent.valid_flag1 |= known.valid_flag1;
+    ds->sent.valid_flag2 |= known.valid_flag2;
+    dualsense_discard(ds);
+    ds->last_output = now;
+    ds->reports_sent++;
+    return true;
+}
+
+static bool dualsense_pending(const struct dualsense *ds)
+{
+    return ds->state.valid_flag0 || ds->state.valid_flag1 || ds->state.valid_flag2;
+}
+
+/* Sends pending changes, waiting for the rate limit if needed. */
+static bool dualsense_flush(struct dualsense *ds)
+{
+    ds->reports_requested += dualsense_pending(ds);
+    return dualsense_send_pending(ds, true);
+}
+
+/* Sends pending changes if the rate limit allows, otherwise coalesces them with later ones. */
+static bool dualsense_try_flush(struct dualsense *ds)
+{
+    ds->reports_requested += dualsense_pending(ds);
+    return dualsense_send_pending(ds, false);
+}
+
+/*
+ * Minimal report descriptors of the DualSense main input/output reports and
+ * the feature reports requested by the hid-playstation driver. Input and output
+ * data is vendor defined, the driver parses raw reports itself.
+ */
+static const uint8_t ds_report_descriptor_usb[] = {
+    0x05, 0x01, 0x09, 0x05, 0xA1, 0x01,
+    0x85, DS_INPUT_REPORT_USB, 0x06, 0x00, 0xFF, 0x09, 0x20, 0x15, 0x00, 0x26, 0xFF, 0x00,
+    0x75, 0x08, 0x95, DS_INPUT_REPORT_USB_SIZE - 1, 0x81, 0x02,
+    0x85, DS_OUTPUT_REPORT_USB, 0x09, 0x21, 0x95, DS_OUTPUT_REPORT_USB_SIZE - 1, 0x91, 0x02,
+    0x85, DS_FEATURE_REPORT_CALIBRATION, 0x09, 0x22, 0x95, DS_FEATURE_REPORT_CALIBRATION_SIZE - 1, 0xB1, 0x02,
+    0x85, DS_FEATURE_REPORT_PAIRING_INFO, 0x09, 0x23, 0x95, DS_FEATURE_REPORT_PAIRING_INFO_SIZE - 1, 0xB1, 0x02,
+    0x85, DS_FEATURE_REPORT_FIRMWARE_INFO, 0x09, 0x24, 0x95, DS_FEATURE_REPORT_FIRMWARE_INFO_SIZE - 1, 0xB1, 0x02,
+    0xC0,
+};
+
+static const uint8_t ds_report_descriptor_bt[] = {
+    0x05, 0x01, 0x09, 0x05, 0xA1, 0x01,
+    0x85, DS_INPUT_REPORT_BT, 0x06, 0x00, 0xFF, 0x09, 0x20, 0x15, 0x00, 0x26, 0xFF, 0x00,
+    0x75, 0x08, 0x95, DS_INPUT_REPORT_BT_SIZE - 1, 0x81, 0x02,
+    0x85, DS_OUTPUT_REPORT_BT, 0x09, 0x21, 0x95, DS_OUTPUT_REPORT_BT_SIZE - 1, 0x91, 0x02,
+    0x85, DS_FEATURE_REPORT_CALIBRATION, 0x09, 0x22, 0x95, DS_FEATURE_REPORT_CALIBRATION_SIZE - 1, 0xB1, 0x02,
+    0x85, DS_FEATURE_REPORT_PAIRING_INFO, 0x09, 0x23, 0x95, DS_FEATURE_REPORT_PAIRING_INFO_SIZE - 1, 0xB1, 0x02,
+    0x85, DS_FEATURE_REPORT_FIRMWARE_INFO, 0x09, 0x24, 0x95, DS_FEATURE_REPORT_FIRMWARE_INFO_SIZE - 1, 0xB1, 0x02,
+    0xC0,
+};
 
-    ds->bt = dev->interface_number == -1;
+/* Virtual DualSense created through uhid. */
+struct virtual_dualsense {
+    int fd;
+    bool bt;
+    uint16_t product_id;
+    char mac_address[18];
+    uint8_t calibration[DS_FEATURE_REPORT_CALIBRATION_SIZE];
+    uint8_t status; /* Battery status of input reports */
+    bool opened;
+};
 
-    ret = true;
+/*
+ * Fills feature report rnum like a real controller would answer, including
+ * the CRC over the last 4 bytes in case of Bluetooth. Returns report size or
+ * 0 for unknown reports.
+ */
+static size_t virtual_dualsense_feature_report(const struct virtual_dualsense *vds, uint8_t rnum, uint8_t *buf)
+{
+    size_t size;
+
+    switch (rnum) {
+    case DS_FEATURE_REPORT_CALIBRATION:
+        size = DS_FEATURE_REPORT_CALIBRATION_SIZE;
+        memcpy(buf, vds->calibration, size);
+        if (buf[0] != DS_FEATURE_REPORT_CALIBRATION) {
+            /* Default calibration: no bias, symmetric ranges */
+            static const int16_t calibration[17] = {
+                0, 0, 0, 8192, -8192, 8192, -8192, 8192, -8192,
+                540, 540, 8192, -8192, 8192, -8192, 8192, -8192,
+            };
+            memset(buf, 0, size);
+            memcpy(buf + 1, calibration, sizeof(calibration));
+        }
+        break;
+    case DS_FEATURE_REPORT_PAIRING_INFO:
+        size = DS_FEATURE_REPORT_PAIRING_INFO_SIZE;
+        memset(buf, 0, size);
+        /* MAC address in reverse byte order */
+        for (int i = 0; i < 6; ++i) {
+            buf[6 - i] = strtol(vds->mac_address + 3 * i, NULL, 16);
+        }
+        break;
+    case DS_FEATURE_REPORT_FIRMWARE_INFO:
+        size = DS_FEATURE_REPORT_FIRMWARE_INFO_SIZE;
+        memset(buf, 0, size);
+        memcpy(buf + 1, "Jan  1 2024", 11);
+        memcpy(buf + 12, "00:00:00", 8);
+        break;
+    default:
+        return 0;
+    }
 
-out:
-    if (devs) {
-        hid_free_enumeration(devs);
+    buf[0] = rnum;
+    if (vds->bt) {
+        uint32_t crc = ~crc32_le(PS_FEATURE_CRC32_STATE, buf, size - 4);
+        memcpy(buf + size - 4, &crc, sizeof(crc));
     }
-    return ret;
+    return size;
 }
 
-static void dualsense_destroy(struct dualsense *ds)
+/* Fills a main input report with idle controls, returns report size. */
+static size_t virtual_dualsense_input_report(const struct virtual_dualsense *vds, uint8_t seq, uint8_t *buf)
 {
-    hid_close(ds->dev);
+    struct dualsense_input_report *report;
+    size_t size;
+
+    if (vds->bt) {
+        size = DS_INPUT_REPORT_BT_SIZE;
+        memset(buf, 0, size);
+        buf[0] = DS_INPUT_REPORT_BT;
+        buf[1] = seq << 4;
+        report = (struct dualsense_input_report *)&buf[2];
+    } else {
+        size = DS_INPUT_REPORT_USB_SIZE;
+        memset(buf, 0, size);
+        buf[0] = DS_INPUT_REPORT_USB;
+        report = (struct dualsense_input_report *)&buf[1];
+    }
+
+    report->x = report->y = report->rx = report->ry = 0x80;
+    report->seq_number = seq;
+    report->buttons[0] = 0x08; /* D-pad released */
+    report->points[0].contact = 0x80; /* No touch */
+    report->points[1].contact = 0x80;
+    report->status = vds->status;
+
+    if (vds->bt) {
+        uint32_t crc = ~crc32_le(PS_INPUT_CRC32_STATE, buf, size - 4);
+        memcpy(buf + size - 4, &crc, sizeof(crc));
+    }
+    return size;
 }
 
-static bool dualsense_bt_disconnect(struct dualsense *ds)
+static bool virtual_dualsense_write(struct virtual_dualsense *vds, const struct uhid_event *ev)
 {
-    DBusError err;
-    dbus_error_init(&err);
-    DBusConnection *conn = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
-    if (dbus_error_is_set(&err)) {
-        fprintf(stderr, "Failed to connect to DBus daemon: %s %s\n", err.name, err.message);
+    if (write(vds->fd, ev, sizeof(*ev)) != sizeof(*ev)) {
+        perror("uhid write");
         return false;
     }
-    DBusMessage *msg = dbus_message_new_method_call("org.bluez", "/", "org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
-    DBusMessage *reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
-    dbus_message_unref(msg);
-    if (dbus_error_is_set(&err)) {
-        fprintf(stderr, "Failed to enumerate BT devices: %s %s\n", err.name, err.message);
+    return true;
+}
+
+static bool virtual_dualsense_create(struct virtual_dualsense *vds)
+{
+    vds->fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+    if (vds->fd < 0) {
+        fprintf(stderr, "Failed to open /dev/uhid: %s\n", strerror(errno));
         return false;
     }
-    DBusMessageIter dict;
-    dbus_message_iter_init(reply, &dict);
-    int objects_count = dbus_message_iter_get_element_count(&dict);
-    DBusMessageIter dict_entry;
-    dbus_message_iter_recurse(&dict, &dict_entry);
-    DBusMessageIter dict_kv;
-    char *ds_path = NULL;
-    char *path, *iface, *prop;
-    while (objects_count-- && !ds_path) {
-        dbus_message_iter_recurse(&dict_entry, &dict_kv);
-        dbus_message_iter_get_basic(&dict_kv, &path);
-        dbus_message_iter_next(&dict_kv);
-        int ifaces_count = dbus_message_iter_get_element_count(&dict_kv);
-        DBusMessageIter ifacedict_entry, ifacedict_kv;
-        dbus_message_iter_recurse(&dict_kv, &ifacedict_entry);
-        while (ifaces_count-- && !ds_path) {
-            dbus_message_iter_recurse(&ifacedict_entry, &ifacedict_kv);
-            dbus_message_iter_get_basic(&ifacedict_kv, &iface);
-            if (!strcmp(iface, "org.bluez.Device1")) {
-                dbus_message_iter_next(&ifacedict_kv);
-                int props_count = dbus_message_iter_get_element_count(&ifacedict_kv);
-                DBusMessageIter propdict_entry, propdict_kv;
-                dbus_message_iter_recurse(&ifacedict_kv, &propdict_entry);
-                while (props_count-- && !ds_path) {
-                    dbus_message_iter_recurse(&propdict_entry, &propdict_kv);
-                    dbus_message_iter_get_basic(&propdict_kv, &prop);
-                    DBusMessageIter variant;
-                    if (!strcmp(prop, "Address")) {
-                        dbus_message_iter_next(&propdict_kv);
-                        dbus_message_iter_recurse(&propdict_kv, &variant);
-                        char *address = NULL;
-                        dbus_message_iter_get_basic(&variant, &address);
-                        if (!strcmp(address, ds->mac_address) && !ds_path) {
-                            ds_path = path;
-                        }
-                    }
-                    dbus_message_iter_next(&propdict_entry);
-                }
-            }
-            dbus_message_iter_next(&ifacedict_entry);
-        }
-        dbus_message_iter_next(&dict_entry);
+
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_CREATE2;
+    snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "%s",
+             vds->product_id == DS_EDGE_PRODUCT_ID ? "DualSense Edge Wireless Controller" : "DualSense Wireless Controller");
+    snprintf((char *)ev.u.create2.phys, sizeof(ev.u.create2.phys), "dualsensectl");
+    for (int i = 0; i < 17; ++i) {
+        ev.u.create2.uniq[i] = tolower(vds->mac_address[i]);
     }
-    dbus_message_unref(reply);
-    if (!ds_path) {
-        fprintf(stderr, "Failed to find BT device\n");
-        return false;
+    ev.u.create2.bus = vds->bt ? BUS_BLUETOOTH : BUS_USB;
+    ev.u.create2.vendor = DS_VENDOR_ID;
+    ev.u.create2.product = vds->product_id;
+    ev.u.create2.version = 0x0100;
+    if (vds->bt) {
+        ev.u.create2.rd_size = sizeof(ds_report_descriptor_bt);
+        memcpy(ev.u.create2.rd_data, ds_report_descriptor_bt, sizeof(ds_report_descriptor_bt));
+    } else {
+        ev.u.create2.rd_size = sizeof(ds_report_descriptor_usb);
+        memcpy(ev.u.create2.rd_data, ds_report_descriptor_usb, sizeof(ds_report_descriptor_usb));
     }
-    msg = dbus_message_new_method_call("org.bluez", ds_path, "org.bluez.Device1", "Disconnect");
-    reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
-    dbus_message_unref(msg);
-    if (dbus_error_is_set(&err)) {
-        fprintf(stderr, "Failed to disconnect BT device: %s %s\n", err.name, err.message);
+
+    if (!virtual_dualsense_write(vds, &ev)) {
+        close(vds->fd);
         return false;
     }
-    dbus_message_unref(reply);
-    dbus_connection_unref(conn);
     return true;
 }
 
-static int command_power_off(struct dualsense *ds)
+static void virtual_dualsense_destroy(struct virtual_dualsense *vds)
 {
-    if (!ds->bt) {
-        fprintf(stderr, "Controller is not connected via BT\n");
-        return 1;
-    }
-    if (!dualsense_bt_disconnect(ds)) {
-        return 2;
-    }
-    return 0;
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_DESTROY;
+    virtual_dualsense_write(vds, &ev);
+    close(vds->fd);
 }
 
-static int command_battery(struct dualsense *ds)
+static bool virtual_dualsense_input(struct virtual_dualsense *vds, const uint8_t *data, size_t len)
 {
-    uint8_t data[DS_INPUT_REPORT_BT_SIZE];
-    int res = hid_read_timeout(ds->dev, data, sizeof(data), 1000);
-    if (res <= 0) {
-        if (res == 0) {
-            fprintf(stderr, "Timeout waiting for report\n");
-        } else {
-            fprintf(stderr, "Failed to read report %ls\n", hid_error(ds->dev));
-        }
-        return 2;
-    }
-
-    struct dualsense_input_report *ds_report;
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_INPUT2;
+    ev.u.input2.size = len;
+    memcpy(ev.u.input2.data, data, len);
+    return virtual_dualsense_write(vds, &ev);
+}
 
-    if (!ds->bt && data[0] == DS_INPUT_REPORT_USB && res == DS_INPUT_REPORT_USB_SIZE) {
-        ds_report = (struct dualsense_input_report *)&data[1];
-    } else if (ds->bt && data[0] == DS_INPUT_REPORT_BT && res == DS_INPUT_REPORT_BT_SIZE) {
-        /* Last 4 bytes of input report contain crc32 */
-        /* uint32_t report_crc = *(uint32_t*)&data[res - 4]; */
-        ds_report = (struct dualsense_input_report *)&data[2];
-    } else {
-        fprintf(stderr, "Unhandled report ID %d\n", (int)data[0]);
-        return 3;
+/* Handles one event from the kernel. Output reports are ignored. */
+static void virtual_dualsense_dispatch(struct virtual_dualsense *vds)
+{
+    struct uhid_event ev;
+    if (read(vds->fd, &ev, sizeof(ev)) <= 0) {
+        return;
     }
 
-    const char *battery_status;
-    uint8_t battery_capacity;
-    uint8_t battery_data = ds_report->status & DS_STATUS_BATTERY_CAPACITY;
-    uint8_t charging_status = (ds_report->status & DS_STATUS_CHARGING) >> DS_STATUS_CHARGING_SHIFT;
-
-#define min(a, b) ((a) < (b) ? (a) : (b))
-    switch (charging_status) {
-    case 0x0:
-        /*
-         * Each unit of battery data corresponds to 10%
-         * 0 = 0-9%, 1 = 10-19%, .. and 10 = 100%
-         */
-        battery_capacity = min(battery_data * 10 + 5, 100);
-        battery_status = "discharging";
+    switch (ev.type) {
+    case UHID_OPEN:
+        vds->opened = true;
         break;
-    case 0x1:
-        battery_capacity = min(battery_data * 10 + 5, 100);
-        battery_status = "charging";
+    case UHID_CLOSE:
+        vds->opened = false;
         break;
-    case 0x2:
-        battery_capacity = 100;
-        battery_status = "full";
+    case UHID_GET_REPORT: {
+        struct uhid_event reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.type = UHID_GET_REPORT_REPLY;
+        reply.u.get_report_reply.id = ev.u.get_report.id;
+        reply.u.get_report_reply.size = virtual_dualsense_feature_report(vds, ev.u.get_report.rnum, reply.u.get_report_reply.data);
+        reply.u.get_report_reply.err = reply.u.get_report_reply.size ? 0 : EIO;
+        virtual_dualsense_write(vds, &reply);
         break;
-    case 0xa: /* voltage or temperature out of range */
-    case 0xb: /* temperature error */
-        battery_capacity = 0;
-        battery_status = "not-charging";
+    }
+    case UHID_SET_REPORT: {
+        struct uhid_event reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.type = UHID_SET_REPORT_REPLY;
+        reply.u.set_report_reply.id = ev.u.set_report.id;
+        virtual_dualsense_write(vds, &reply);
         break;
-    case 0xf: /* charging error */
+    }
     default:
-        battery_capacity = 0;
-        battery_status = "unknown";
+        break;
     }
-#undef min
+}
 
-    printf("%d %s\n", (int)battery_capacity, battery_status);
-    return 0;
+#ifndef DUALSENSECTL_NO_HIDAPI
+static const char *hidapi_error(void *dev)
+{
+    static char buf[256];
+    const wchar_t *err = hid_error(dev);
+    snprintf(buf, sizeof(buf), "%ls", err ? err : L"Unknown error");
+    return buf;
 }
 
-static int command_info(struct dualsense *ds)
+static struct dualsense_device_info **hidapi_append(struct dualsense_device_info **end, uint16_t product_id)
 {
-    uint8_t buf[DS_FEATURE_REPORT_FIRMWARE_INFO_SIZE];
-    memset(buf, 0, sizeof(buf));
-    buf[0] = DS_FEATURE_REPORT_FIRMWARE_INFO;
-    int res = hid_get_feature_report(ds->dev, buf, sizeof(buf));
-    if (res != sizeof(buf)) {
-        fprintf(stderr, "Invalid feature report\n");
-        return false;
+    struct hid_device_info *devs = hid_enumerate(DS_VENDOR_ID, product_id);
+    for (struct hid_device_info *dev = devs; dev; dev = dev->next) {
+        struct dualsense_device_info *info = calloc(1, sizeof(*info));
+        if (!info) {
+            break;
+        }
+        snprintf(info->path, sizeof(info->path), "%s", dev->path);
+        if (dev->serial_number) {
+            snprintf(info->serial, sizeof(info->serial), "%ls", dev->serial_number);
+        }
+        info->product_id = dev->product_id;
+#if HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+        info->bt = dev->bus_type == HID_API_BUS_BLUETOOTH;
+#else
+        info->bt = dev->interface_number == -1;
+#endif
+        *end = info;
+        end = &info->next;
     }
+    hid_free_enumeration(devs);
+    return end;
+}
 
-    struct dualsense_feature_report_firmware *ds_report;
-    ds_report = (struct dualsense_feature_report_firmware *)&buf;
+static struct dualsense_device_info *hidapi_enumerate(void)
+{
+    struct dualsense_device_info *devs = NULL;
+    hidapi_append(hidapi_append(&devs, DS_PRODUCT_ID), DS_EDGE_PRODUCT_ID);
+    return devs;
+}
 
-    printf("Hardware: %x\n", ds_report->hardware_info);
-    printf("Build date: %.11s %.8s\n", ds_report->build_date, ds_report->build_time);
-    printf("Firmware: %x (type %i)\n", ds_report->firmware_version, ds_report->fw_type);
-    printf("Fw version: %i %i %i\n", ds_report->fw_version_1, ds_report->fw_version_2, ds_report->fw_version_3);
-    printf("Sw series: %i\n", ds_report->sw_series);
-    printf("Update version: %04x\n", ds_report->update_version);
-    /* printf("Device info: %.12s\n", ds_report->device_info); */
-    /* printf("Update image info: %c\n", ds_report->update_image_info); */
+static void *hidapi_open(const struct dualsense_device_info *info)
+{
+    return hid_open_path(info->path);
+}
 
-    return 0;
+static void hidapi_close(void *dev)
+{
+    hid_close(dev);
 }
 
-static int command_lightbar1(struct dualsense *ds, char *state)
+static int hidapi_write(void *dev, const uint8_t *data, size_t len)
 {
-    struct dualsense_output_report rp;
-    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
-    dualsense_init_output_report(ds, &rp, rbuf);
+    return hid_write(dev, data, len);
+}
 
-    rp.common->valid_flag2 = DS_OUTPUT_VALID_FLAG2_LIGHTBAR_SETUP_CONTROL_ENABLE;
-    if (!strcmp(state, "on")) {
-        rp.common->lightbar_setup = DS_OUTPUT_LIGHTBAR_SETUP_LIGHT_ON;
-    } else if (!strcmp(state, "off")) {
-        rp.common->lightbar_setup = DS_OUTPUT_LIGHTBAR_SETUP_LIGHT_OUT;
-    } else {
-        fprintf(stderr, "Invalid state\n");
-        return 1;
-    }
-
-    dualsense_send_output_report(ds, &rp);
-
-    return 0;
+static int hidapi_read_timeout(void *dev, uint8_t *data, size_t len, int timeout)
+{
+    return hid_read_timeout(dev, data, len, timeout);
 }
 
-static int command_lightbar3(struct dualsense *ds, uint8_t red, uint8_t green, uint8_t blue, uint8_t brightness)
+static int hidapi_get_feature_report(void *dev, uint8_t *data, size_t len)
 {
-    struct dualsense_output_report rp;
-    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
-    dualsense_init_output_report(ds, &rp, rbuf);
-
-    uint8_t max_brightness = 255;
+    return hid_get_feature_report(dev, data, len);
+}
 
-    rp.common->valid_flag1 = DS_OUTPUT_VALID_FLAG1_LIGHTBAR_CONTROL_ENABLE;
-    rp.common->lightbar_red = brightness * red / max_brightness;
-    rp.common->lightbar_green = brightness * green / max_brightness;
-    rp.common->lightbar_blue = brightness * blue / max_brightness;
+static const struct dualsense_transport hidapi_transport = {
+    .name = "hidapi",
+    .enumerate = hidapi_enumerate,
+    .open = hidapi_open,
+    .close = hidapi_close,
+    .write = hidapi_write,
+    .read_timeout = hidapi_read_timeout,
+    .get_feature_report = hidapi_get_feature_report,
+    .error = hidapi_error,
+    .cacheable = true,
+};
+#endif
 
-    dualsense_send_output_report(ds, &rp);
+/* Native backend using hidraw nodes directly, enumerated through udev. */
+struct hidraw_device {
+    int fd;
+    char error[128];
+};
 
-    return 0;
-}
+static char hidraw_open_error[PATH_MAX + 64];
 
-static int command_led_brightness(struct dualsense *ds, uint8_t number)
+/* Fills info from a hidraw udev device, false if it is not a DualSense. */
+static bool hidraw_device_info(struct udev_device *dev, struct dualsense_device_info *info)
 {
-    if (number > 2) {
-        fprintf(stderr, "Invalid brightness level\n");
-        return 1;
+    struct udev_device *hid = udev_device_get_parent_with_subsystem_devtype(dev, "hid", NULL);
+    const char *id = hid ? udev_device_get_property_value(hid, "HID_ID") : NULL;
+    const char *uniq = hid ? udev_device_get_property_value(hid, "HID_UNIQ") : NULL;
+    const char *devnode = udev_device_get_devnode(dev);
+    unsigned bus, vendor, product;
+    if (!id || !devnode || sscanf(id, "%x:%x:%x", &bus, &vendor, &product) != 3 ||
+        vendor != DS_VENDOR_ID || (product != DS_PRODUCT_ID && product != DS_EDGE_PRODUCT_ID)) {
+        return false;
     }
 
-    struct dualsense_output_report rp;
-    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
-    dualsense_init_output_report(ds, &rp, rbuf);
-
-    rp.common->valid_flag2 = DS_OUTPUT_VALID_FLAG2_LED_BRIGHTNESS_CONTROL_ENABLE;
-    rp.common->led_brightness = number;
-
-    dualsense_send_output_report(ds, &rp);
-
-    return 0;
+    memset(info, 0, sizeof(*info));
+    snprintf(info->path, sizeof(info->path), "%s", devnode);
+    snprintf(info->serial, sizeof(info->serial), "%s", uniq ? uniq : "");
+    info->product_id = product;
+    info->bt = bus == BUS_BLUETOOTH;
+    return true;
 }
 
-static int command_player_leds(struct dualsense *ds, uint8_t number, bool instant)
+static struct dualsense_device_info *hidraw_enumerate(void)
 {
-    static const int player_ids[] = {
-        0,
-        BIT(2),
-        BIT(3) | BIT(1),
-        BIT(4) | BIT(2) | BIT(0),
-        BIT(4) | BIT(3) | BIT(1) | BIT(0),
-        BIT(4) | BIT(3) | BIT(2) | BIT(1) | BIT(0),
-        BIT(4) | BIT(0),
-        BIT(3) | BIT(2) | BIT(1),
-    };
+    struct dualsense_device_info *devs = NULL;
+    struct dualsense_device_info **end = &devs;
 
-    if (number >= sizeof(player_ids)/sizeof(*player_ids)) {
-        fprintf(stderr, "Invalid player number\n");
-        return 1;
+    struct udev *udev = udev_new();
+    if (!udev) {
+        return NULL;
     }
+    struct udev_enumerate *enumerate = udev_enumerate_new(udev);
+    udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+    udev_enumerate_scan_devices(enumerate);
 
-    struct dualsense_output_report rp;
-    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
-    dualsense_init_output_report(ds, &rp, rbuf);
-
-    rp.common->valid_flag1 = DS_OUTPUT_VALID_FLAG1_PLAYER_INDICATOR_CONTROL_ENABLE;
-    rp.common->player_leds = player_ids[number] | (instant << 5);
-
-    dualsense_send_output_report(ds, &rp);
+    struct udev_list_entry *entry;
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+        struct udev_device *dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(entry));
+        if (!dev) {
+            continue;
+        }
+        struct dualsense_device_info info;
+        if (hidraw_device_info(dev, &info)) {
+            *end = malloc(sizeof(info));
+            if (*end) {
+                **end = info;
+                end = &(*end)->next;
+            }
+        }
+        udev_device_unref(dev);
+    }
 
-    return 0;
+    udev_enumerate_unref(enumerate);
+    udev_unref(udev);
+    return devs;
 }
 
-static int command_microphone(struct dualsense *ds, char *state)
+static void *hidraw_open(const struct dualsense_device_info *info)
 {
-    struct dualsense_output_report rp;
-    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
-    dualsense_init_output_report(ds, &rp, rbuf);
-
-    rp.common->valid_flag1 = DS_OUTPUT_VALID_FLAG1_POWER_SAVE_CONTROL_ENABLE;
-    if (!strcmp(state, "on")) {
-        rp.common->power_save_control &= ~DS_OUTPUT_POWER_SAVE_CONTROL_MIC_MUTE;
-    } else if (!strcmp(state, "off")) {
-        rp.common->power_save_control |= DS_OUTPUT_POWER_SAVE_CONTROL_MIC_MUTE;
-    } else {
-        fprintf(stderr, "Invalid state\n");
-        return 1;
+    struct hidraw_device *dev = calloc(1, sizeof(*dev));
+    if (!dev) {
+        snprintf(hidraw_open_error, sizeof(hidraw_open_error), "%s", strerror(errno));
+        return NULL;
     }
+    dev->fd = open(info->path, O_RDWR | O_CLOEXEC);
+    if (dev->fd < 0) {
+        snprintf(hidraw_open_error, sizeof(hidraw_open_error), "%s: %s", info->path, strerror(errno));
+        free(dev);
+        return NULL;
+    }
+    return dev;
+}
 
-    dualsense_send_output_report(ds, &rp);
+static void hidraw_close(void *data)
+{
+    struct hidraw_device *dev = data;
+    close(dev->fd);
+    free(dev);
+}
 
-    return 0;
+static int hidraw_result(struct hidraw_device *dev, ssize_t res)
+{
+    if (res < 0) {
+        snprintf(dev->error, sizeof(dev->error), "%s", strerror(errno));
+        return -1;
+    }
+    return res;
 }
 
-static int command_microphone_led(struct dualsense *ds, char *state)
+static int hidraw_write(void *data, const uint8_t *buf, size_t len)
 {
-    struct dualsense_output_report rp;
-    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
-    dualsense_init_output_report(ds, &rp, rbuf);
+    struct hidraw_device *dev = data;
+    return hidraw_result(dev, write(dev->fd, buf, len));
+}
 
-    rp.common->valid_flag1 = DS_OUTPUT_VALID_FLAG1_MIC_MUTE_LED_CONTROL_ENABLE;
-    if (!strcmp(state, "on")) {
-        rp.common->mute_button_led = 1;
-    } else if (!strcmp(state, "off")) {
-        rp.common->mute_button_led = 0;
-    } else if (!strcmp(state, "pulse")) {
-        rp.common->mute_button_led = 2;
-    } else {
-        fprintf(stderr, "Invalid state\n");
-        return 1;
+static int hidraw_read_timeout(void *data, uint8_t *buf, size_t len, int timeout)
+{
+    struct hidraw_device *dev = data;
+    struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+    int res = poll(&pfd, 1, timeout);
+    if (res <= 0) {
+        return res < 0 && errno != EINTR ? hidraw_result(dev, res) : 0;
+    }
+    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        snprintf(dev->error, sizeof(dev->error), "Device disconnected");
+        return -1;
     }
+    return hidraw_result(dev, read(dev->fd, buf, len));
+}
 
-    dualsense_send_output_report(ds, &rp);
+static int hidraw_get_feature_report(void *data, uint8_t *buf, size_t len)
+{
+    struct hidraw_device *dev = data;
+    return hidraw_result(dev, ioctl(dev->fd, HIDIOCGFEATURE(len), buf));
+}
 
-    return 0;
+static const char *hidraw_error(void *data)
+{
+    struct hidraw_device *dev = data;
+    return dev ? dev->error : hidraw_open_error;
 }
 
-static int command_microphone_mode(struct dualsense *ds, char *state)
+static int hidraw_fd(void *data)
 {
-    struct dualsense_output_report rp;
-    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
-    dualsense_init_output_report(ds, &rp, rbuf);
+    return ((struct hidraw_device *)data)->fd;
+}
 
-    rp.common->valid_flag0 = DS_OUTPUT_VALID_FLAG0_AUDIO_CONTROL_ENABLE;
-    if (!strcmp(state, "chat")) {
-        rp.common->audio_flags = 1 << DS_OUTPUT_AUDIO_INPUT_PATH_SHIFT;
-    } else if (!strcmp(state, "asr")) {
-        rp.common->audio_flags = 2 << DS_OUTPUT_AUDIO_INPUT_PATH_SHIFT;
-    } else if (!strcmp(state, "both")) {
-        rp.common->audio_flags = 0;
-    } else {
-        fprintf(stderr, "Invalid state\n");
-        return 1;
-    }
+static const struct dualsense_transport hidraw_transport = {
+    .name = "hidraw",
+    .enumerate = hidraw_enumerate,
+    .open = hidraw_open,
+    .close = hidraw_close,
+    .write = hidraw_write,
+    .read_timeout = hidraw_read_timeout,
+    .get_feature_report = hidraw_get_feature_report,
+    .error = hidraw_error,
+    .fd = hidraw_fd,
+    .cacheable = true,
+};
 
-    dualsense_send_output_report(ds, &rp);
+/*
+ * In-process mock controllers, one connected over USB and one over Bluetooth.
+ * They answer feature reports like a real controller, produce idle input
+ * reports at the real rate and check output reports.
+ */
+#define MOCK_DEVICES 2
+
+struct mock_dualsense {
+    struct virtual_dualsense vds;
+    uint8_t seq;
+    uint64_t next_report;
+    uint64_t interval;
+    int timer_fd; /* Expires with each input report */
+    char error[64];
+};
 
-    return 0;
-}
+static char mock_error[64];
 
-static int command_speaker(struct dualsense *ds, char *state)
+static struct dualsense_device_info *mock_enumerate(void)
 {
-    struct dualsense_output_report rp;
-    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
-    dualsense_init_output_report(ds, &rp, rbuf);
+    struct dualsense_device_info *devs = NULL;
+    struct dualsense_device_info **end = &devs;
+    for (int i = 0; i < MOCK_DEVICES; ++i) {
+        struct dualsense_device_info *info = calloc(1, sizeof(*info));
+        if (!info) {
+            break;
+        }
+        snprintf(info->path, sizeof(info->path), "mock:%d", i);
+        snprintf(info->serial, sizeof(info->serial), "00:11:22:33:44:%02x", i + 1);
+        info->product_id = DS_PRODUCT_ID;
+        info->bt = i == 1;
+        *end = info;
+        end = &info->next;
+    }
+    return devs;
+}
 
-    rp.common->valid_flag0 = DS_OUTPUT_VALID_FLAG0_AUDIO_CONTROL_ENABLE;
-    /* value
-     * | /left headphone
-     * | | / right headphone
-     * | | | / internal speaker
-     * 0 L_R_X
-     * 1 L_L_X
-     * 2 L_L_R
-     * 3 X_X_R
-     */
-    if (!strcmp(state, "internal")) { /* right channel to speaker */
-        rp.common->audio_flags = 3 << DS_OUTPUT_AUDIO_OUTPUT_PATH_SHIFT;
-    } else if (!strcmp(state, "headphone")) { /* stereo channel to headphone */
-        rp.common->audio_flags = 0;
-    } else if (!strcmp(state, "monoheadphone")) { /* left channel to headphone */
-        rp.common->audio_flags = 1 << DS_OUTPUT_AUDIO_OUTPUT_PATH_SHIFT;
-    } else if (!strcmp(state, "both")) { /* left channel to headphone, right channel to speaker */
-        rp.common->audio_flags = 2 << DS_OUTPUT_AUDIO_OUTPUT_PATH_SHIFT;
-    } else {
-        fprintf(stderr, "Invalid state\n");
-        return 1;
+static void *mock_open(const struct dualsense_device_info *info)
+{
+    struct mock_dualsense *mock = calloc(1, sizeof(*mock));
+    if (!mock) {
+        snprintf(mock_error, sizeof(mock_error), "%s", strerror(errno));
+        return NULL;
+    }
+    mock->vds.fd = -1;
+    mock->vds.bt = info->bt;
+    mock->vds.product_id = info->product_id;
+    mock->vds.status = 0x08; /* Discharging, 80-89% */
+    snprintf(mock->vds.mac_address, sizeof(mock->vds.mac_address), "%.17s", info->serial);
+    mock->interval = info->bt ? 4000000 : 1000000;
+    mock->next_report = monotonic_ns();
+
+    mock->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (mock->timer_fd < 0) {
+        snprintf(mock_error, sizeof(mock_error), "%s", strerror(errno));
+        free(mock);
+        return NULL;
     }
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_nsec = mock->interval;
+    its.it_value.tv_nsec = 1;
+    timerfd_settime(mock->timer_fd, 0, &its, NULL);
+    return mock;
+}
 
-    dualsense_send_output_report(ds, &rp);
+static void mock_close(void *dev)
+{
+    struct mock_dualsense *mock = dev;
+    close(mock->timer_fd);
+    free(mock);
+}
 
-    return 0;
+static int mock_fd(void *dev)
+{
+    return ((struct mock_dualsense *)dev)->timer_fd;
 }
 
-static int command_volume(struct dualsense *ds, uint8_t volume)
+static int mock_write(void *dev, const uint8_t *data, size_t len)
 {
-    struct dualsense_output_report rp;
-    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
-    dualsense_init_output_report(ds, &rp, rbuf);
+    struct mock_dualsense *mock = dev;
+    if (mock->vds.bt) {
+        uint32_t crc = ~crc32_le(PS_OUTPUT_CRC32_STATE, data, len - 4);
+        if (data[0] != DS_OUTPUT_REPORT_BT || len != DS_OUTPUT_REPORT_BT_SIZE || memcmp(data + len - 4, &crc, sizeof(crc))) {
+            snprintf(mock->error, sizeof(mock->error), "Invalid output report");
+            return -1;
+        }
+    } else if (data[0] != DS_OUTPUT_REPORT_USB || len != DS_OUTPUT_REPORT_USB_SIZE) {
+        snprintf(mock->error, sizeof(mock->error), "Invalid output report");
+        return -1;
+    }
+    return len;
+}
 
-    uint8_t max_volume = 255;
+static int mock_read_timeout(void *dev, uint8_t *data, size_t len, int timeout)
+{
+    struct mock_dualsense *mock = dev;
+    uint64_t now = monotonic_ns();
 
-    /* TODO see if we can get old values of volumes to be able to set values independently */
-    rp.common->valid_flag0 = DS_OUTPUT_VALID_FLAG0_HEADPHONE_VOLUME_ENABLE;
-    rp.common->headphone_audio_volume = volume * 0x7f / max_volume;
+    if (now < mock->next_report) {
+        uint64_t wait = mock->next_report - now;
+        if (timeout >= 0 && wait > (uint64_t)timeout * 1000000) {
+            wait = (uint64_t)timeout * 1000000;
+        }
+        struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+        nanosleep(&ts, NULL);
+        if (monotonic_ns() < mock->next_report) {
+            return 0;
+        }
+    }
 
-    rp.common->valid_flag0 |= DS_OUTPUT_VALID_FLAG0_SPEAKER_VOLUME_ENABLE;
-    /* the PS5 use 0x3d-0x64 trying over 0x64 doesnt change but below 0x3d can still lower the volume */
-    rp.common->speaker_audio_volume = volume * 0x64 / max_volume;
+    /* Skip reports nobody read in time like the kernel would drop them */
+    mock->next_report += mock->interval;
+    if (mock->next_report < now) {
+        mock->next_report = now + mock->interval;
+    }
 
-    /* if we want to set speaker pre gain */
-    //rp.common->valid_flag1 = DS_OUTPUT_VALID_FLAG1_AUDIO_CONTROL2_ENABLE;
-    //rp.common->audio_flags2 = 4;
+    uint64_t expirations;
+    if (read(mock->timer_fd, &expirations, sizeof(expirations)) < 0) {
+        /* Not expired yet, nothing to clear */
+    }
 
-    dualsense_send_output_report(ds, &rp);
+    uint8_t buf[DS_INPUT_REPORT_BT_SIZE];
+    size_t size = virtual_dualsense_input_report(&mock->vds, mock->seq++, buf);
+    size = size < len ? size : len;
+    memcpy(data, buf, size);
+    return size;
+}
 
-    return 0;
+static int mock_get_feature_report(void *dev, uint8_t *data, size_t len)
+{
+    struct mock_dualsense *mock = dev;
+    uint8_t buf[DS_FEATURE_REPORT_FIRMWARE_INFO_SIZE];
+    size_t size = virtual_dualsense_feature_report(&mock->vds, data[0], buf);
+    if (!size) {
+        snprintf(mock->error, sizeof(mock->error), "Unknown feature report 0x%02x", data[0]);
+        return -1;
+    }
+    size = size < len ? size : len;
+    memcpy(data, buf, size);
+    return size;
 }
 
-static int command_vibration_attenuation(struct dualsense *ds, uint8_t rumble_attenuation, uint8_t trigger_attenuation)
+static const char *mock_error_string(void *dev)
 {
-    struct dualsense_output_report rp;
-    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
-    dualsense_init_output_report(ds, &rp, rbuf);
+    return dev ? ((struct mock_dualsense *)dev)->error : mock_error;
+}
 
-    /* need to store or get current values if we want to change motor/haptic and trigger separately */
-    rp.common->valid_flag1 = DS_OUTPUT_VALID_FLAG1_VIBRATION_ATTENUATION_ENABLE;
-    rp.common->reduce_motor_power = (uint8_t)((rumble_attenuation & 0x07) | ((trigger_attenuation & 0x07) << 4 ));
+static const struct dualsense_transport mock_transport = {
+    .name = "mock",
+    .enumerate = mock_enumerate,
+    .open = mock_open,
+    .close = mock_close,
+    .write = mock_write,
+    .read_timeout = mock_read_timeout,
+    .get_feature_report = mock_get_feature_report,
+    .error = mock_error_string,
+    .fd = mock_fd,
+};
 
-    dualsense_send_output_report(ds, &rp);
+static const struct dualsense_transport *const dualsense_transports[] = {
+#ifndef DUALSENSECTL_NO_HIDAPI
+    &hidapi_transport,
+#endif
+    &hidraw_transport,
+    &mock_transport,
+};
 
-    return 0;
+/*
+ * Returns the backend named in $DUALSENSECTL_BACKEND or the build default.
+ * Exits on an unknown name rather than falling back to a real controller.
+ */
+static const struct dualsense_transport *dualsense_transport(void)
+{
+    static const struct dualsense_transport *transport;
+    if (!transport) {
+        const char *name = getenv("DUALSENSECTL_BACKEND");
+        if (!name) {
+            transport = dualsense_transports[0];
+        }
+        for (size_t i = 0; name && i < sizeof(dualsense_transports) / sizeof(*dualsense_transports); ++i) {
+            if (!strcmp(name, dualsense_transports[i]->name)) {
+                transport = dualsense_transports[i];
+            }
+        }
+        if (!transport) {
+            fprintf(stderr, "Unknown backend '%s' in DUALSENSECTL_BACKEND\n", name);
+            exit(1);
+        }
+    }
+    return transport;
 }
 
-static int command_trigger(struct dualsense *ds, char *trigger, uint8_t mode, uint8_t param1, uint8_t param2, uint8_t param3, uint8_t param4, uint8_t param5, uint8_t param6, uint8_t param7, uint8_t param8, uint8_t param9 )
+static void dualsense_free_enumeration(struct dualsense_device_info *devs)
 {
-    struct dualsense_output_report rp;
-    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
-    dualsense_init_output_report(ds, &rp, rbuf);
-
-    if (!strcmp(trigger, "right") || !strcmp(trigger, "both")) {
-        rp.common->valid_flag0 = DS_OUTPUT_VALID_FLAG0_RIGHT_TRIGGER_MOTOR_ENABLE;
+    while (devs) {
+        struct dualsense_device_info *next = devs->next;
+        free(devs);
+        devs = next;
     }
-    if (!strcmp(trigger, "left") || !strcmp(trigger, "both")) {
-        rp.common->valid_flag0 |= DS_OUTPUT_VALID_FLAG0_LEFT_TRIGGER_MOTOR_ENABLE;
-    }
-
-    rp.common->right_trigger_motor_mode = mode;
-    rp.common->right_trigger_param[0] = param1;
-    rp.common->right_trigger_param[1] = param2;
-    rp.common->right_trigger_param[2] = param3;
-    rp.common->right_trigger_param[3] = param4;
-    rp.common->right_trigger_param[4] = param5;
-    rp.common->right_trigger_param[5] = param6;
-    rp.common->right_trigger_param[6] = param7;
-    rp.common->right_trigger_param[7] = param8;
-    rp.common->right_trigger_param[8] = param9;
-
-    rp.common->left_trigger_motor_mode = mode;
-    rp.common->left_trigger_param[0] = param1;
-    rp.common->left_trigger_param[1] = param2;
-    rp.common->left_trigger_param[2] = param3;
-    rp.common->left_trigger_param[3] = param4;
-    rp.common->left_trigger_param[4] = param5;
-    rp.common->left_trigger_param[5] = param6;
-    rp.common->left_trigger_param[6] = param7;
-    rp.common->left_trigger_param[7] = param8;
-    rp.common->left_trigger_param[8] = param9;
-
-    dualsense_send_output_report(ds, &rp);
-
-    return 0;
 }
 
-static int command_trigger_off(struct dualsense *ds, char *trigger)
+static bool compare_serial(const char *s, const char *dev)
 {
-    return command_trigger(ds, trigger, DS_TRIGGER_EFFECT_OFF, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    return !s || !strcasecmp(s, dev);
 }
 
-static int trigger_bitpacking_array(struct dualsense *ds, char *trigger, uint8_t mode, uint8_t strength[10], uint8_t frequency)
+/*
+ * Runtime files like caches live in the private $XDG_RUNTIME_DIR only, a
+ * shared directory like /tmp would let other users plant or redirect them.
+ * Returns false if there is no runtime directory and they should be skipped.
+ */
+static bool runtime_file_path(const char *name, char *path, size_t size)
 {
-    uint32_t strength_zones = 0;
-    uint16_t active_zones = 0;
-    for (int i = 0; i < 10; i++) {
-        if (strength[i] > 8) {
-            fprintf(stderr, "strengths must be between 0 and 8\n");
-            return 1;
-        }
-        if (strength[i] > 0) {
-            uint8_t strength_value = (uint8_t)((strength[i] -1) & 0x07);
-            strength_zones |= (uint32_t)(strength_value << (3 * i));
-            active_zones |= (uint16_t)(1 << i);
-        }
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (!runtime_dir || !*runtime_dir) {
+        return false;
     }
-
-    return command_trigger(ds, trigger, mode,
-                           (uint8_t)((active_zones >> 0) & 0xff),
-                           (uint8_t)((active_zones >> 8) & 0xff),
-                           (uint8_t)((strength_zones >> 0) & 0xff),
-                           (uint8_t)((strength_zones >> 8) & 0xff),
-                           (uint8_t)((strength_zones >> 16) & 0xff),
-                           (uint8_t)((strength_zones >> 24) & 0xff),
-                           0, 0,
-                           frequency);
+    snprintf(path, size, "%s/%s", runtime_dir, name);
+    return true;
 }
 
-static int command_trigger_feedback(struct dualsense *ds, char *trigger, uint8_t position, uint8_t strength)
+/* Opens a runtime file for reading if it is a regular file only we can write. */
+static FILE *runtime_file_open(const char *path, struct stat *st)
 {
-    if (position > 9) {
-        fprintf(stderr, "position must be between 0 and 9\n");
-        return 1;
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
     }
-    if (strength > 8 || !(strength > 0)) {
-        fprintf(stderr, "strength must be between 1 and 8\n");
-        return 1;
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode) || st->st_uid != geteuid() || (st->st_mode & 022)) {
+        close(fd);
+        return NULL;
     }
-    uint8_t strength_array[10] = {0};
-    for (int i = position; i < 10; i++) {
-        strength_array[i] = strength;
+    FILE *f = fdopen(fd, "r");
+    if (!f) {
+        close(fd);
     }
-
-    return trigger_bitpacking_array(ds, trigger, DS_TRIGGER_EFFECT_FEEDBACK, strength_array, 0);
+    return f;
 }
 
-static int command_trigger_weapon(struct dualsense *ds, char *trigger, uint8_t start_position, uint8_t end_position, uint8_t strength)
+/* Creates a new private temporary file next to path, see runtime_file_commit(). */
+static FILE *runtime_file_create(const char *path, char *tmp, size_t size)
 {
-    if (start_position > 7 || start_position < 2) {
-        fprintf(stderr, "start position must be between 2 and 7\n");
-        return 1;
-    }
-    if (end_position > 8 || end_position < start_position+1) {
-        fprintf(stderr, "end position must be between start position+1 and 8\n");
-        return 1;
+    snprintf(tmp, size, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        return NULL;
     }
-    if (strength > 8 || !(strength > 0)) {
-        fprintf(stderr, "strength must be between 1 and 8\n");
-        return 1;
+    FILE *f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        unlink(tmp);
     }
-
-    uint16_t start_stop_zones = (uint16_t)((1 << start_position) | (1 << end_position));
-    return command_trigger(ds, trigger, DS_TRIGGER_EFFECT_WEAPON,
-                           (uint8_t)((start_stop_zones >> 0) & 0xff),
-                           (uint8_t)((start_stop_zones >> 8) & 0xff),
-                           strength-1,
-                           0, 0, 0, 0, 0, 0);
+    return f;
 }
 
-static int command_trigger_bow(struct dualsense *ds, char *trigger, uint8_t start_position, uint8_t end_position, uint8_t strength, uint8_t snap_force)
+/* Closes a file from runtime_file_create() and atomically replaces path with it. */
+static void runtime_file_commit(FILE *f, const char *tmp, const char *path)
 {
-    if (start_position > 8 || !(start_position > 0)) {
-        fprintf(stderr, "start position must be between 0 and 8\n");
-        return 1;
+    if (fclose(f) || rename(tmp, path)) {
+        unlink(tmp);
+    }
+}
+
+/*
+ * Compiled files are written to a unique temporary file and renamed into
+ * place, so concurrent compiles do not mix and readers mapping the old file
+ * never see a partial one. Unlike runtime files they get the usual umask
+ * permissions.
+ */
+static FILE *compiled_file_create(const char *path, char *tmp, size_t size)
+{
+    FILE *f = runtime_file_create(path, tmp, size);
+    if (f) {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fileno(f), 0666 & ~mask);
+    }
+    return f;
+}
+
+/* Syncs and closes a file from compiled_file_create(), replacing path with it if ok. */
+static bool compiled_file_commit(FILE *f, const char *tmp, const char *path, bool ok)
+{
+    ok = ok && !fflush(f) && !fsync(fileno(f));
+    ok = !fclose(f) && ok;
+    if (!ok || rename(tmp, path)) {
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Cache of the last enumeration mapping serials to hidraw nodes, so a device
+ * given with -d can be opened without walking all HID devices. hidraw numbers
+ * are reused, so entries are checked against the live HID_UNIQ in sysfs.
+ */
+static bool device_cache_valid(const struct dualsense_device_info *info)
+{
+    if (strncmp(info->path, "/dev/hidraw", 11)) {
+        return false;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent", info->path + 5);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+
+    bool valid = false;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, "HID_UNIQ=", 9)) {
+            line[strcspn(line, "\n")] = 0;
+            valid = !strcasecmp(line + 9, info->serial);
+            break;
+        }
+    }
+    fclose(f);
+    return valid;
+}
+
+static bool device_cache_lookup(const char *serial, struct dualsense_device_info *info)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    FILE *f = runtime_file_path("dualsensectl.devices", path, sizeof(path)) ? runtime_file_open(path, &st) : NULL;
+    if (!f) {
+        return false;
+    }
+
+    bool found = false;
+    int bt;
+    memset(info, 0, sizeof(*info));
+    while (fscanf(f, "%31s %255s %hx %d", info->serial, info->path, &info->product_id, &bt) == 4) {
+        if (!strcasecmp(info->serial, serial)) {
+            info->bt = bt;
+            found = device_cache_valid(info);
+            break;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+static void device_cache_store(const struct dualsense_device_info *devs)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 16];
+    FILE *f = runtime_file_path("dualsensectl.devices", path, sizeof(path)) ? runtime_file_create(path, tmp, sizeof(tmp)) : NULL;
+    if (!f) {
+        return;
+    }
+    for (const struct dualsense_device_info *dev = devs; dev; dev = dev->next) {
+        if (dev->serial[0] && !strchr(dev->serial, ' ')) {
+            fprintf(f, "%s %s %04x %d\n", dev->serial, dev->path, dev->product_id, dev->bt);
+        }
+    }
+    runtime_file_commit(f, tmp, path);
+}
+
+/* Enumerates devices and refreshes the cache. */
+static struct dualsense_device_info *dualsense_enumerate(const struct dualsense_transport *transport)
+{
+    struct dualsense_device_info *devs = transport->enumerate();
+    if (transport->cacheable) {
+        device_cache_store(devs);
+    }
+    return devs;
+}
+
+/* Output reports per second, -1 for the transport default and 0 for no limit. */
+static int output_rate = -1;
+
+/* Sets up ds for a device handle already opened by the transport. */
+static void dualsense_attach(struct dualsense *ds, const struct dualsense_transport *transport, const struct dualsense_device_info *dev, void *handle)
+{
+    memset(ds, 0, sizeof(*ds));
+
+    ds->transport = transport;
+    ds->dev = handle;
+
+    const char *serial_number = dev->serial;
+
+    if (strlen(serial_number) != 17) {
+        fprintf(stderr, "Invalid device serial number: %s\n", serial_number);
+        // Let's just fake serial number as everything except disconnecting will still work
+        serial_number = "00:00:00:00:00:00";
+    }
+
+    for (int i = 0; i < 18; ++i) {
+        char c = serial_number[i];
+        if (c && (i + 1) % 3) {
+            c = toupper(c);
+        }
+        ds->mac_address[i] = c;
+    }
+
+    ds->bt = dev->bt;
+    ds->product_id = dev->product_id;
+    ds->out = stdout;
+    int rate = output_rate >= 0 ? output_rate : ds->bt ? DS_OUTPUT_RATE_BT : 0;
+    ds->min_interval = rate ? 1000000000 / rate : 0;
+    snprintf(ds->path, sizeof(ds->path), "%s", dev->path);
+}
+
+static bool dualsense_open(struct dualsense *ds, const struct dualsense_transport *transport, const struct dualsense_device_info *dev)
+{
+    void *handle = transport->open(dev);
+    if (!handle) {
+        fprintf(stderr, "Failed to open device: %s\n", transport->error(NULL));
+        return false;
+    }
+    dualsense_attach(ds, transport, dev, handle);
+    return true;
+}
+
+static bool dualsense_init(struct dualsense *ds, const char *serial)
+{
+    const struct dualsense_transport *transport = dualsense_transport();
+
+    /* A stale cache entry is not an error, enumeration below finds the device */
+    struct dualsense_device_info cached;
+    if (serial && transport->cacheable && device_cache_lookup(serial, &cached)) {
+        void *handle = transport->open(&cached);
+        if (handle) {
+            dualsense_attach(ds, transport, &cached, handle);
+            return true;
+        }
+    }
+
+    bool ret = false;
+    struct dualsense_device_info *devs = dualsense_enumerate(transport);
+    struct dualsense_device_info *dev = devs;
+    while (dev) {
+        if (compare_serial(serial, dev->serial)) {
+            break;
+        }
+        dev = dev->next;
+    }
+
+    if (!dev) {
+        if (serial) {
+            fprintf(stderr, "Device '%s' not found\n", serial);
+        } else {
+            fprintf(stderr, "No device found\n");
+        }
+    } else {
+        ret = dualsense_open(ds, transport, dev);
+    }
+
+    dualsense_free_enumeration(devs);
+    return ret;
+}
+
+static void dualsense_destroy(struct dualsense *ds)
+{
+    ds->transport->close(ds->dev);
+}
+
+static bool dualsense_bt_disconnect(struct dualsense *ds)
+{
+    DBusError err;
+    dbus_error_init(&err);
+    DBusConnection *conn = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
+    if (dbus_error_is_set(&err)) {
+        fprintf(stderr, "Failed to connect to DBus daemon: %s %s\n", err.name, err.message);
+        return false;
+    }
+    DBusMessage *msg = dbus_message_new_method_call("org.bluez", "/", "org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
+    DBusMessage *reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
+    dbus_message_unref(msg);
+    if (dbus_error_is_set(&err)) {
+        fprintf(stderr, "Failed to enumerate BT devices: %s %s\n", err.name, err.message);
+        return false;
+    }
+    DBusMessageIter dict;
+    dbus_message_iter_init(reply, &dict);
+    int objects_count = dbus_message_iter_get_element_count(&dict);
+    DBusMessageIter dict_entry;
+    dbus_message_iter_recurse(&dict, &dict_entry);
+    DBusMessageIter dict_kv;
+    char *ds_path = NULL;
+    char *path, *iface, *prop;
+    while (objects_count-- && !ds_path) {
+        dbus_message_iter_recurse(&dict_entry, &dict_kv);
+        dbus_message_iter_get_basic(&dict_kv, &path);
+        dbus_message_iter_next(&dict_kv);
+        int ifaces_count = dbus_message_iter_get_element_count(&dict_kv);
+        DBusMessageIter ifacedict_entry, ifacedict_kv;
+        dbus_message_iter_recurse(&dict_kv, &ifacedict_entry);
+        while (ifaces_count-- && !ds_path) {
+            dbus_message_iter_recurse(&ifacedict_entry, &ifacedict_kv);
+            dbus_message_iter_get_basic(&ifacedict_kv, &iface);
+            if (!strcmp(iface, "org.bluez.Device1")) {
+                dbus_message_iter_next(&ifacedict_kv);
+                int props_count = dbus_message_iter_get_element_count(&ifacedict_kv);
+                DBusMessageIter propdict_entry, propdict_kv;
+                dbus_message_iter_recurse(&ifacedict_kv, &propdict_entry);
+                while (props_count-- && !ds_path) {
+                    dbus_message_iter_recurse(&propdict_entry, &propdict_kv);
+                    dbus_message_iter_get_basic(&propdict_kv, &prop);
+                    DBusMessageIter variant;
+                    if (!strcmp(prop, "Address")) {
+                        dbus_message_iter_next(&propdict_kv);
+                        dbus_message_iter_recurse(&propdict_kv, &variant);
+                        char *address = NULL;
+                        dbus_message_iter_get_basic(&variant, &address);
+                        if (!strcmp(address, ds->mac_address) && !ds_path) {
+                            ds_path = path;
+                        }
+                    }
+                    dbus_message_iter_next(&propdict_entry);
+                }
+            }
+            dbus_message_iter_next(&ifacedict_entry);
+        }
+        dbus_message_iter_next(&dict_entry);
+    }
+    dbus_message_unref(reply);
+    if (!ds_path) {
+        fprintf(stderr, "Failed to find BT device\n");
+        return false;
+    }
+    msg = dbus_message_new_method_call("org.bluez", ds_path, "org.bluez.Device1", "Disconnect");
+    reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
+    dbus_message_unref(msg);
+    if (dbus_error_is_set(&err)) {
+        fprintf(stderr, "Failed to disconnect BT device: %s %s\n", err.name, err.message);
+        return false;
+    }
+    dbus_message_unref(reply);
+    dbus_connection_unref(conn);
+    return true;
+}
+
+static int command_power_off(struct dualsense *ds)
+{
+    if (!ds->bt) {
+        fprintf(stderr, "Controller is not connected via BT\n");
+        return 1;
+    }
+    if (!dualsense_bt_disconnect(ds)) {
+        return 2;
+    }
+    return 0;
+}
+
+/*
+ * Returns the main input report inside a report read from the device, or NULL
+ * if it is some other report. BT reports with a wrong CRC are counted in
+ * input_crc_errors and rejected.
+ */
+static struct dualsense_input_report *dualsense_parse_input_report(struct dualsense *ds, uint8_t *data, int len)
+{
+    if (!ds->bt && data[0] == DS_INPUT_REPORT_USB && len == DS_INPUT_REPORT_USB_SIZE) {
+        return (struct dualsense_input_report *)&data[1];
+    } else if (ds->bt && data[0] == DS_INPUT_REPORT_BT && len == DS_INPUT_REPORT_BT_SIZE) {
+        /* Last 4 bytes of input report contain crc32 */
+        uint32_t report_crc;
+        memcpy(&report_crc, &data[len - 4], sizeof(report_crc));
+        if (report_crc != ~crc32_le(PS_INPUT_CRC32_STATE, data, len - 4)) {
+            ds->input_crc_errors++;
+            return NULL;
+        }
+        return (struct dualsense_input_report *)&data[2];
+    }
+    return NULL;
+}
+
+static void dualsense_battery_status(const struct dualsense_input_report *ds_report, uint8_t *capacity, const char **status)
+{
+    uint8_t battery_data = ds_report->status & DS_STATUS_BATTERY_CAPACITY;
+    uint8_t charging_status = (ds_report->status & DS_STATUS_CHARGING) >> DS_STATUS_CHARGING_SHIFT;
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+    switch (charging_status) {
+    case 0x0:
+        /*
+         * Each unit of battery data corresponds to 10%
+         * 0 = 0-9%, 1 = 10-19%, .. and 10 = 100%
+         */
+        *capacity = min(battery_data * 10 + 5, 100);
+        *status = "discharging";
+        break;
+    case 0x1:
+        *capacity = min(battery_data * 10 + 5, 100);
+        *status = "charging";
+        break;
+    case 0x2:
+        *capacity = 100;
+        *status = "full";
+        break;
+    case 0xa: /* voltage or temperature out of range */
+    case 0xb: /* temperature error */
+        *capacity = 0;
+        *status = "not-charging";
+        break;
+    case 0xf: /* charging error */
+    default:
+        *capacity = 0;
+        *status = "unknown";
+    }
+#undef min
+}
+
+/* Battery state of one controller, see battery --all. */
+struct battery_entry {
+    char mac_address[18];
+    bool bt;
+    bool valid;
+    uint8_t capacity;
+    char status[16];
+};
+
+static void battery_entry_set(struct battery_entry *e, const struct dualsense *ds, const struct dualsense_input_report *report)
+{
+    const char *status;
+    memcpy(e->mac_address, ds->mac_address, sizeof(e->mac_address));
+    e->bt = ds->bt;
+    e->valid = true;
+    dualsense_battery_status(report, &e->capacity, &status);
+    snprintf(e->status, sizeof(e->status), "%s", status);
+}
+
+static void print_battery_entries(const struct battery_entry *entries, int count, bool json)
+{
+    if (json) {
+        printf("[");
+    } else {
+        printf("%-17s  %-9s  %-8s  %s\n", "MAC", "TRANSPORT", "CAPACITY", "STATUS");
+    }
+    for (int i = 0; i < count; ++i) {
+        const struct battery_entry *e = &entries[i];
+        const char *transport = e->bt ? "bt" : "usb";
+        const char *status = e->valid ? e->status : "unavailable";
+        if (json) {
+            printf("%s{\"mac\":\"%s\",\"transport\":\"%s\",\"capacity\":", i ? "," : "", e->mac_address, transport);
+            if (e->valid) {
+                printf("%u", e->capacity);
+            } else {
+                printf("null");
+            }
+            printf(",\"status\":\"%s\"}", status);
+        } else if (e->valid) {
+            printf("%-17s  %-9s  %-8u  %s\n", e->mac_address, transport, e->capacity, status);
+        } else {
+            printf("%-17s  %-9s  %-8s  %s\n", e->mac_address, transport, "-", status);
+        }
+    }
+    if (json) {
+        printf("]\n");
+    }
+}
+
+static int command_battery(struct dualsense *ds)
+{
+    uint8_t data[DS_INPUT_REPORT_BT_SIZE];
+    int res = ds->transport->read_timeout(ds->dev, data, sizeof(data), 1000);
+    if (res <= 0) {
+        if (res == 0) {
+            fprintf(stderr, "Timeout waiting for report\n");
+        } else {
+            fprintf(stderr, "Failed to read report %s\n", ds->transport->error(ds->dev));
+            ds->failed = true;
+        }
+        return 2;
+    }
+
+    struct dualsense_input_report *ds_report = dualsense_parse_input_report(ds, data, res);
+    if (!ds_report) {
+        if (ds->input_crc_errors) {
+            fprintf(stderr, "Input report CRC mismatch\n");
+        } else {
+            fprintf(stderr, "Unhandled report ID %d\n", (int)data[0]);
+        }
+        return 3;
+    }
+
+    const char *battery_status;
+    uint8_t battery_capacity;
+    dualsense_battery_status(ds_report, &battery_capacity, &battery_status);
+
+    fprintf(ds->out, "%d %s\n", (int)battery_capacity, battery_status);
+    return 0;
+}
+
+static volatile sig_atomic_t quit_requested = 0;
+
+static void quit_handler(int sig)
+{
+    (void)sig;
+    quit_requested = 1;
+}
+
+/* Makes SIGINT/SIGTERM interrupt blocking calls and end long running commands. */
+static void install_quit_handler(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = quit_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+/* Binary stream record, the raw main input report with host receive time. */
+struct dualsense_stream_record {
+    uint64_t timestamp; /* CLOCK_MONOTONIC in ns */
+    struct dualsense_input_report report;
+} __attribute__((packed));
+
+static void print_input_report_json(uint64_t timestamp, const struct dualsense_input_report *r)
+{
+    const char *battery_status;
+    uint8_t battery_capacity;
+    dualsense_battery_status(r, &battery_capacity, &battery_status);
+
+    uint32_t buttons = r->buttons[0] | r->buttons[1] << 8 | r->buttons[2] << 16 | (uint32_t)r->buttons[3] << 24;
+    printf("{\"time\":%" PRIu64 ",\"seq\":%u,\"sensor_timestamp\":%" PRIu32 ","
+           "\"sticks\":[%u,%u,%u,%u],\"triggers\":[%u,%u],\"buttons\":%" PRIu32 ","
+           "\"gyro\":[%d,%d,%d],\"accel\":[%d,%d,%d],\"touch\":[",
+           timestamp, r->seq_number, (uint32_t)r->sensor_timestamp,
+           r->x, r->y, r->rx, r->ry, r->z, r->rz, buttons,
+           (int16_t)r->gyro[0], (int16_t)r->gyro[1], (int16_t)r->gyro[2],
+           (int16_t)r->accel[0], (int16_t)r->accel[1], (int16_t)r->accel[2]);
+    for (int i = 0; i < 2; ++i) {
+        const struct dualsense_touch_point *p = &r->points[i];
+        printf("%s{\"active\":%s,\"id\":%u,\"x\":%u,\"y\":%u}", i ? "," : "",
+               p->contact & 0x80 ? "false" : "true", p->contact & 0x7f,
+               p->x_lo | p->x_hi << 8, p->y_lo | p->y_hi << 4);
+    }
+    printf("],\"battery\":%u,\"status\":\"%s\"}\n", battery_capacity, battery_status);
+}
+
+static int command_stream(struct dualsense *ds, const char *format)
+{
+    bool binary;
+    if (!format || !strcmp(format, "json")) {
+        binary = false;
+    } else if (!strcmp(format, "binary")) {
+        binary = true;
+    } else {
+        fprintf(stderr, "Invalid format\n");
+        return 1;
+    }
+
+    install_quit_handler();
+
+    uint8_t data[DS_INPUT_REPORT_BT_SIZE];
+    uint64_t reports = 0, dropped = 0;
+    int last_seq = -1;
+    int ret = 0;
+
+    while (!quit_requested) {
+        /* Only flush output once all queued reports are written */
+        int res = ds->transport->read_timeout(ds->dev, data, sizeof(data), 0);
+        if (res == 0) {
+            fflush(stdout);
+            res = ds->transport->read_timeout(ds->dev, data, sizeof(data), 1000);
+        }
+        if (res < 0) {
+            if (!quit_requested) {
+                fprintf(stderr, "Failed to read report %s\n", ds->transport->error(ds->dev));
+                ds->failed = true;
+                ret = 2;
+            }
+            break;
+        }
+        uint64_t timestamp = monotonic_ns();
+        struct dualsense_input_report *ds_report = res ? dualsense_parse_input_report(ds, data, res) : NULL;
+        if (!ds_report) {
+            continue;
+        }
+
+        if (last_seq >= 0) {
+            dropped += (uint8_t)(ds_report->seq_number - last_seq - 1);
+        }
+        last_seq = ds_report->seq_number;
+        reports++;
+
+        if (binary) {
+            struct dualsense_stream_record record = { timestamp, *ds_report };
+            fwrite(&record, sizeof(record), 1, stdout);
+        } else {
+            print_input_report_json(timestamp, ds_report);
+        }
+        if (ferror(stdout)) {
+            ret = 2;
+            break;
+        }
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "%" PRIu64 " reports, %" PRIu64 " dropped, %" PRIu64 " corrupted\n", reports, dropped, ds->input_crc_errors);
+    return ret;
+}
+
+/*
+ * Recording file format: a fixed size header followed by fixed stride records
+ * of raw input reports. Records are appended in time order, so the record
+ * count follows from the file size and records can be looked up by time with
+ * a binary search on a mmap of the file.
+ */
+#define DS_RECORDING_MAGIC "DSREC\0\0\0"
+#define DS_RECORDING_VERSION 1
+#define DS_RECORDING_BUFFERED 512
+
+struct dualsense_recording_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint16_t product_id;
+    uint8_t bt;
+    char mac_address[18];
+    uint8_t calibration[DS_FEATURE_REPORT_CALIBRATION_SIZE];
+    uint8_t reserved[6];
+    uint64_t start_time; /* CLOCK_REALTIME in ns */
+    uint8_t reserved2[32];
+} __attribute__((packed));
+_Static_assert(sizeof(struct dualsense_recording_header) == 128, "Bad recording header size");
+
+struct dualsense_recording_record {
+    uint64_t timestamp; /* ns since start of recording */
+    uint8_t len;
+    uint8_t data[DS_INPUT_REPORT_BT_SIZE]; /* Raw report including report ID and CRC */
+    uint8_t reserved[1];
+} __attribute__((packed));
+_Static_assert(sizeof(struct dualsense_recording_record) % 8 == 0, "Bad recording record size");
+
+struct dualsense_recording {
+    void *map;
+    size_t map_size;
+    const struct dualsense_recording_header *header;
+    const struct dualsense_recording_record *records;
+    size_t count;
+};
+
+static bool dualsense_recording_open(struct dualsense_recording *rec, const char *path)
+{
+    memset(rec, 0, sizeof(*rec));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*rec->header)) {
+        fprintf(stderr, "Invalid recording %s\n", path);
+        close(fd);
+        return false;
+    }
+    rec->map_size = st.st_size;
+    rec->map = mmap(NULL, rec->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (rec->map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    rec->header = rec->map;
+    if (memcmp(rec->header->magic, DS_RECORDING_MAGIC, sizeof(rec->header->magic)) ||
+        rec->header->version != DS_RECORDING_VERSION ||
+        rec->header->header_size != sizeof(struct dualsense_recording_header) ||
+        rec->header->record_size != sizeof(struct dualsense_recording_record)) {
+        fprintf(stderr, "Invalid recording %s\n", path);
+        munmap(rec->map, rec->map_size);
+        return false;
+    }
+    rec->records = (const struct dualsense_recording_record *)((const uint8_t *)rec->map + rec->header->header_size);
+    rec->count = (rec->map_size - rec->header->header_size) / rec->header->record_size;
+
+    /* Replay copies len bytes and searches by time, so both must be sane */
+    uint8_t len = rec->header->bt ? DS_INPUT_REPORT_BT_SIZE : DS_INPUT_REPORT_USB_SIZE;
+    for (size_t i = 0; i < rec->count; ++i) {
+        if (rec->records[i].len != len || (i && rec->records[i].timestamp < rec->records[i - 1].timestamp)) {
+            fprintf(stderr, "Invalid recording %s: bad record %zu\n", path, i);
+            munmap(rec->map, rec->map_size);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void dualsense_recording_close(struct dualsense_recording *rec)
+{
+    munmap(rec->map, rec->map_size);
+}
+
+/* Index of the first record at or after timestamp. */
+static size_t dualsense_recording_find(const struct dualsense_recording *rec, uint64_t timestamp)
+{
+    size_t lo = 0, hi = rec->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (rec->records[mid].timestamp < timestamp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int command_record(struct dualsense *ds, const char *path)
+{
+    struct dualsense_recording_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DS_RECORDING_MAGIC, sizeof(header.magic));
+    header.version = DS_RECORDING_VERSION;
+    header.header_size = sizeof(header);
+    header.record_size = sizeof(struct dualsense_recording_record);
+    header.product_id = ds->product_id;
+    header.bt = ds->bt;
+    memcpy(header.mac_address, ds->mac_address, sizeof(header.mac_address));
+
+    header.calibration[0] = DS_FEATURE_REPORT_CALIBRATION;
+    if (ds->transport->get_feature_report(ds->dev, header.calibration, sizeof(header.calibration)) != sizeof(header.calibration)) {
+        fprintf(stderr, "Failed to read calibration, recording without it\n");
+        memset(header.calibration, 0, sizeof(header.calibration));
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.start_time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    uint64_t start = monotonic_ns();
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        perror("write");
+        close(fd);
+        return 2;
+    }
+
+    install_quit_handler();
+
+    static struct dualsense_recording_record buffer[DS_RECORDING_BUFFERED];
+    size_t buffered = 0;
+    off_t offset = sizeof(header);
+    uint64_t reports = 0;
+    int ret = 0;
+
+    while (1) {
+        bool done = quit_requested;
+        struct dualsense_recording_record *r = &buffer[buffered];
+        int res = 0;
+        if (!done) {
+            res = ds->transport->read_timeout(ds->dev, r->data, sizeof(r->data), 1000);
+            if (res < 0) {
+                if (!quit_requested) {
+                    fprintf(stderr, "Failed to read report %s\n", ds->transport->error(ds->dev));
+                    ds->failed = true;
+                    ret = 2;
+                }
+                done = true;
+            }
+        }
+        if (res > 0 && dualsense_parse_input_report(ds, r->data, res)) {
+            r->timestamp = monotonic_ns() - start;
+            r->len = res;
+            r->reserved[0] = 0;
+            buffered++;
+            reports++;
+        }
+        if (buffered == DS_RECORDING_BUFFERED || (done && buffered)) {
+            ssize_t size = buffered * sizeof(*buffer);
+            if (pwrite(fd, buffer, size, offset) != size) {
+                perror("write");
+                ret = 2;
+                break;
+            }
+            offset += size;
+            buffered = 0;
+        }
+        if (done) {
+            break;
+        }
+    }
+
+    close(fd);
+    fprintf(stderr, "%" PRIu64 " reports recorded, %" PRIu64 " corrupted\n", reports, ds->input_crc_errors);
+    return ret;
+}
+
+static int command_replay(const char *path, double from)
+{
+    struct dualsense_recording rec;
+    if (!dualsense_recording_open(&rec, path)) {
+        return 1;
+    }
+
+    /* Only used for parsing reports of the recorded transport */
+    struct dualsense ds;
+    memset(&ds, 0, sizeof(ds));
+    ds.bt = rec.header->bt;
+
+    install_quit_handler();
+
+    for (size_t i = dualsense_recording_find(&rec, from * 1e9); i < rec.count && !quit_requested; ++i) {
+        uint8_t data[DS_INPUT_REPORT_BT_SIZE];
+        memcpy(data, rec.records[i].data, sizeof(data));
+        struct dualsense_input_report *ds_report = dualsense_parse_input_report(&ds, data, rec.records[i].len);
+        if (ds_report) {
+            print_input_report_json(rec.records[i].timestamp, ds_report);
+        }
+    }
+
+    dualsense_recording_close(&rec);
+    return 0;
+}
+
+/* Collects lateness of actual vs scheduled times in 1us buckets. */
+#define JITTER_BUCKETS 1000
+
+struct jitter_stats {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t histogram[JITTER_BUCKETS + 1];
+};
+
+static void jitter_stats_add(struct jitter_stats *stats, uint64_t scheduled, uint64_t actual)
+{
+    uint64_t lateness = actual > scheduled ? actual - scheduled : 0;
+    uint64_t bucket = lateness / 1000;
+
+    if (!stats->count || lateness < stats->min) {
+        stats->min = lateness;
+    }
+    if (lateness > stats->max) {
+        stats->max = lateness;
+    }
+    stats->count++;
+    stats->sum += lateness;
+    stats->histogram[bucket < JITTER_BUCKETS ? bucket : JITTER_BUCKETS]++;
+}
+
+static double jitter_stats_percentile(const struct jitter_stats *stats, double percentile)
+{
+    uint64_t target = stats->count * percentile / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < JITTER_BUCKETS; ++i) {
+        seen += stats->histogram[i];
+        if (seen > target) {
+            return i + 1;
+        }
+    }
+    return stats->max / 1000.0;
+}
+
+static void jitter_stats_print(const struct jitter_stats *stats)
+{
+    if (!stats->count) {
+        return;
+    }
+    fprintf(stderr, "Jitter (us): min %.1f avg %.1f p50 <%.0f p99 <%.0f max %.1f\n",
+            stats->min / 1000.0, stats->sum / 1000.0 / stats->count,
+            jitter_stats_percentile(stats, 50), jitter_stats_percentile(stats, 99),
+            stats->max / 1000.0);
+}
+
+/* Waits until the absolute CLOCK_MONOTONIC time in a timerfd. */
+static void timerfd_set_deadline(int fd, uint64_t deadline)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / 1000000000;
+    its.it_value.tv_nsec = deadline % 1000000000;
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int command_replay_uhid(const char *path, double from)
+{
+    struct dualsense_recording rec;
+    if (!dualsense_recording_open(&rec, path)) {
+        return 1;
+    }
+
+    struct virtual_dualsense vds;
+    memset(&vds, 0, sizeof(vds));
+    vds.bt = rec.header->bt;
+    vds.product_id = rec.header->product_id ? rec.header->product_id : DS_PRODUCT_ID;
+    memcpy(vds.mac_address, rec.header->mac_address, sizeof(vds.mac_address) - 1);
+    memcpy(vds.calibration, rec.header->calibration, sizeof(vds.calibration));
+    if (!virtual_dualsense_create(&vds)) {
+        dualsense_recording_close(&rec);
+        return 2;
+    }
+
+    install_quit_handler();
+    /* Default 50us timer slack is too coarse for 1 kHz reports */
+    prctl(PR_SET_TIMERSLACK, 1);
+
+    struct pollfd fds[2];
+    fds[0].fd = vds.fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    fds[1].events = POLLIN;
+
+    /* Give the kernel driver time to probe and open the device */
+    uint64_t deadline = monotonic_ns() + 2000000000ULL;
+    timerfd_set_deadline(fds[1].fd, deadline);
+    while (!vds.opened && !quit_requested && poll(fds, 2, -1) > 0) {
+        if (fds[0].revents & POLLIN) {
+            virtual_dualsense_dispatch(&vds);
+        }
+        if (fds[1].revents & POLLIN) {
+            fprintf(stderr, "Device was not opened, replaying anyway\n");
+            break;
+        }
+    }
+
+    static struct jitter_stats jitter;
+    memset(&jitter, 0, sizeof(jitter));
+    size_t i = dualsense_recording_find(&rec, from * 1e9);
+    uint64_t first = i < rec.count ? rec.records[i].timestamp : 0;
+    uint64_t base = monotonic_ns() + 1000000;
+    uint64_t reports = 0;
+    int ret = 0;
+
+    if (i < rec.count) {
+        timerfd_set_deadline(fds[1].fd, base);
+    }
+    while (i < rec.count && !quit_requested) {
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            virtual_dualsense_dispatch(&vds);
+        }
+        if (!(fds[1].revents & POLLIN)) {
+            continue;
+        }
+        uint64_t expirations;
+        if (read(fds[1].fd, &expirations, sizeof(expirations)) < 0) {
+            continue;
+        }
+
+        jitter_stats_add(&jitter, base + rec.records[i].timestamp - first, monotonic_ns());
+        if (!virtual_dualsense_input(&vds, rec.records[i].data, rec.records[i].len)) {
+            ret = 2;
+            break;
+        }
+        reports++;
+        if (++i < rec.count) {
+            timerfd_set_deadline(fds[1].fd, base + rec.records[i].timestamp - first);
+        }
+    }
+
+    close(fds[1].fd);
+    virtual_dualsense_destroy(&vds);
+    dualsense_recording_close(&rec);
+
+    fprintf(stderr, "%" PRIu64 " reports replayed\n", reports);
+    jitter_stats_print(&jitter);
+    return ret;
+}
+
+/* Keeps a virtual controller on uhid sending idle input reports until interrupted. */
+static int command_mock(bool bt, const char *mac_address)
+{
+    struct virtual_dualsense vds;
+    memset(&vds, 0, sizeof(vds));
+    vds.bt = bt;
+    vds.product_id = DS_PRODUCT_ID;
+    vds.status = 0x08; /* Discharging, 80-89% */
+    snprintf(vds.mac_address, sizeof(vds.mac_address), "%s", mac_address);
+    if (!virtual_dualsense_create(&vds)) {
+        return 2;
+    }
+
+    install_quit_handler();
+    printf("Created %s (%s)\n", vds.mac_address, bt ? "Bluetooth" : "USB");
+    fflush(stdout);
+
+    struct pollfd fds[2];
+    fds[0].fd = vds.fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    fds[1].events = POLLIN;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_nsec = bt ? 4000000 : 1000000;
+    its.it_value = its.it_interval;
+    timerfd_settime(fds[1].fd, 0, &its, NULL);
+
+    uint8_t seq = 0;
+    int ret = 0;
+    while (!quit_requested) {
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            virtual_dualsense_dispatch(&vds);
+        }
+        uint64_t expirations;
+        if ((fds[1].revents & POLLIN) && read(fds[1].fd, &expirations, sizeof(expirations)) > 0 && vds.opened) {
+            uint8_t buf[DS_INPUT_REPORT_BT_SIZE];
+            size_t size = virtual_dualsense_input_report(&vds, seq++, buf);
+            if (!virtual_dualsense_input(&vds, buf, size)) {
+                ret = 2;
+                break;
+            }
+        }
+    }
+
+    close(fds[1].fd);
+    virtual_dualsense_destroy(&vds);
+    return ret;
+}
+
+static int command_info(struct dualsense *ds)
+{
+    uint8_t buf[DS_FEATURE_REPORT_FIRMWARE_INFO_SIZE];
+    memset(buf, 0, sizeof(buf));
+    buf[0] = DS_FEATURE_REPORT_FIRMWARE_INFO;
+    int res = ds->transport->get_feature_report(ds->dev, buf, sizeof(buf));
+    if (res != sizeof(buf)) {
+        fprintf(stderr, "Invalid feature report\n");
+        ds->failed = res < 0;
+        return false;
+    }
+
+    struct dualsense_feature_report_firmware *ds_report;
+    ds_report = (struct dualsense_feature_report_firmware *)&buf;
+
+    fprintf(ds->out, "Hardware: %x\n", ds_report->hardware_info);
+    fprintf(ds->out, "Build date: %.11s %.8s\n", ds_report->build_date, ds_report->build_time);
+    fprintf(ds->out, "Firmware: %x (type %i)\n", ds_report->firmware_version, ds_report->fw_type);
+    fprintf(ds->out, "Fw version: %i %i %i\n", ds_report->fw_version_1, ds_report->fw_version_2, ds_report->fw_version_3);
+    fprintf(ds->out, "Sw series: %i\n", ds_report->sw_series);
+    fprintf(ds->out, "Update version: %04x\n", ds_report->update_version);
+    /* printf("Device info: %.12s\n", ds_report->device_info); */
+    /* printf("Update image info: %c\n", ds_report->update_image_info); */
+
+    return 0;
+}
+
+static int command_lightbar1(struct dualsense *ds, char *state)
+{
+    uint8_t setup;
+    if (!strcmp(state, "on")) {
+        setup = DS_OUTPUT_LIGHTBAR_SETUP_LIGHT_ON;
+    } else if (!strcmp(state, "off")) {
+        setup = DS_OUTPUT_LIGHTBAR_SETUP_LIGHT_OUT;
+    } else {
+        fprintf(stderr, "Invalid state\n");
+        return 1;
+    }
+
+    ds->state.valid_flag2 |= DS_OUTPUT_VALID_FLAG2_LIGHTBAR_SETUP_CONTROL_ENABLE;
+    ds->state.lightbar_setup = setup;
+
+    return 0;
+}
+
+static int command_lightbar3(struct dualsense *ds, uint8_t red, uint8_t green, uint8_t blue, uint8_t brightness)
+{
+    uint8_t max_brightness = 255;
+
+    ds->state.valid_flag1 |= DS_OUTPUT_VALID_FLAG1_LIGHTBAR_CONTROL_ENABLE;
+    ds->state.lightbar_red = brightness * red / max_brightness;
+    ds->state.lightbar_green = brightness * green / max_brightness;
+    ds->state.lightbar_blue = brightness * blue / max_brightness;
+
+    return 0;
+}
+
+#define LIGHTBAR_MAX_KEYFRAMES 64
+#define LIGHTBAR_MAX_FPS 250 /* Bluetooth output report rate */
+
+enum lightbar_easing {
+    LIGHTBAR_EASING_LINEAR,
+    LIGHTBAR_EASING_IN,
+    LIGHTBAR_EASING_OUT,
+    LIGHTBAR_EASING_IN_OUT,
+    LIGHTBAR_EASING_STEP,
+};
+
+static const char *const lightbar_easing_names[] = {
+    "linear", "in", "out", "in-out", "step",
+};
+
+/* Color reached at time, easing applies to the transition from the previous keyframe. */
+struct lightbar_keyframe {
+    double time;
+    uint8_t rgb[3];
+    enum lightbar_easing easing;
+};
+
+struct lightbar_animation {
+    bool rainbow; /* Hue cycle over period instead of keyframes */
+    bool loop;
+    double period;
+    int count;
+    struct lightbar_keyframe keyframes[LIGHTBAR_MAX_KEYFRAMES];
+};
+
+static double lightbar_ease(enum lightbar_easing easing, double x)
+{
+    switch (easing) {
+    case LIGHTBAR_EASING_IN:
+        return x * x;
+    case LIGHTBAR_EASING_OUT:
+        return 1 - (1 - x) * (1 - x);
+    case LIGHTBAR_EASING_IN_OUT:
+        return x * x * (3 - 2 * x);
+    case LIGHTBAR_EASING_STEP:
+        return x < 1 ? 0 : 1;
+    case LIGHTBAR_EASING_LINEAR:
+    default:
+        return x;
+    }
+}
+
+static void lightbar_hsv(double hue, uint8_t rgb[3])
+{
+    int sector = hue * 6;
+    uint8_t rise = (hue * 6 - sector) * 255;
+    uint8_t fall = 255 - rise;
+    static const int8_t map[6][3] = {
+        { -1, 1, 0 }, { 2, -1, 0 }, { 0, -1, 1 }, { 0, 2, -1 }, { 1, 0, -1 }, { -1, 0, 2 },
+    };
+    for (int i = 0; i < 3; ++i) {
+        int8_t m = map[sector % 6][i];
+        rgb[i] = m < 0 ? 255 : m == 0 ? 0 : m == 1 ? rise : fall;
+    }
+}
+
+/* Returns false once a non looping animation is over. */
+static bool lightbar_animation_color(const struct lightbar_animation *a, double t, uint8_t rgb[3])
+{
+    if (a->loop && a->period > 0) {
+        t -= a->period * (uint64_t)(t / a->period);
+    }
+
+    if (a->rainbow) {
+        lightbar_hsv(t / a->period, rgb);
+        return true;
+    }
+
+    const struct lightbar_keyframe *prev = &a->keyframes[0];
+    for (int i = 0; i < a->count; ++i) {
+        const struct lightbar_keyframe *next = &a->keyframes[i];
+        if (t < next->time) {
+            double span = next->time - prev->time;
+            double x = lightbar_ease(next->easing, span > 0 ? (t - prev->time) / span : 1);
+            for (int c = 0; c < 3; ++c) {
+                rgb[c] = prev->rgb[c] + (next->rgb[c] - prev->rgb[c]) * x + 0.5;
+            }
+            return true;
+        }
+        prev = next;
+    }
+    memcpy(rgb, prev->rgb, 3);
+    return a->loop;
+}
+
+static bool lightbar_add_keyframe(struct lightbar_animation *a, double time, uint8_t red, uint8_t green, uint8_t blue, enum lightbar_easing easing)
+{
+    if (a->count == LIGHTBAR_MAX_KEYFRAMES || (a->count && time < a->keyframes[a->count - 1].time)) {
+        return false;
+    }
+    struct lightbar_keyframe *k = &a->keyframes[a->count++];
+    k->time = time;
+    k->rgb[0] = red;
+    k->rgb[1] = green;
+    k->rgb[2] = blue;
+    k->easing = easing;
+    a->period = time;
+    return true;
+}
+
+/* Keyframe file lines are "TIME RED GREEN BLUE [EASING]", # starts a comment. */
+static bool lightbar_load_keyframes(struct lightbar_animation *a, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char line[256];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineno++;
+        line[strcspn(line, "#\n")] = 0;
+        double time;
+        int red, green, blue;
+        char easing[16] = "linear";
+        int n = sscanf(line, "%lf %i %i %i %15s", &time, &red, &green, &blue, easing);
+        if (n <= 0) {
+            continue;
+        }
+        size_t e = 0;
+        while (e < sizeof(lightbar_easing_names) / sizeof(*lightbar_easing_names) && strcmp(easing, lightbar_easing_names[e])) {
+            e++;
+        }
+        if (n < 4 || e == sizeof(lightbar_easing_names) / sizeof(*lightbar_easing_names) ||
+            !lightbar_add_keyframe(a, time, red, green, blue, e)) {
+            fprintf(stderr, "%s:%d: Invalid keyframe\n", path, lineno);
+            ok = false;
+        }
+    }
+    fclose(f);
+
+    if (ok && !a->count) {
+        fprintf(stderr, "%s: No keyframes\n", path);
+        ok = false;
+    }
+    return ok;
+}
+
+/*
+ * Plays an animation at fps frames per second for duration seconds (0 for
+ * the animation length). Frames with unchanged colors are not sent thanks to
+ * the output state cache.
+ */
+static int command_lightbar_animate(struct dualsense *ds, const struct lightbar_animation *a, int fps, double duration)
+{
+    install_quit_handler();
+
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        perror("timerfd_create");
+        return 2;
+    }
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_nsec = 1000000000 / fps;
+    its.it_value.tv_nsec = 1;
+    timerfd_settime(timer_fd, 0, &its, NULL);
+
+    int ret = 0;
+    uint64_t start = monotonic_ns();
+    while (!quit_requested) {
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+            continue;
+        }
+
+        double t = (monotonic_ns() - start) / 1e9;
+        uint8_t rgb[3];
+        bool more = lightbar_animation_color(a, t, rgb);
+        if (duration > 0) {
+            more = t < duration;
+        }
+        command_lightbar3(ds, rgb[0], rgb[1], rgb[2], 255);
+        if (!dualsense_try_flush(ds)) {
+            ret = 2;
+            break;
+        }
+        if (!more) {
+            break;
+        }
+    }
+
+    close(timer_fd);
+    if (!ret && !dualsense_flush(ds)) {
+        ret = 2;
+    }
+    fprintf(stderr, "%" PRIu64 " frames requested, %" PRIu64 " output reports sent\n", ds->reports_requested, ds->reports_sent);
+    return ret;
+}
+
+static int parse_animate(struct dualsense *ds, int argc, char *argv[])
+{
+    int fps = 60;
+    double duration = 0;
+    argc--;
+    argv++;
+    while (argc > 1 && argv[0][0] == '-') {
+        if (!strcmp(argv[0], "-f")) {
+            fps = atoi_x(argv[1]);
+        } else if (!strcmp(argv[0], "-t")) {
+            duration = strtod(argv[1], NULL);
+        } else {
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (fps < 1 || fps > LIGHTBAR_MAX_FPS) {
+        fprintf(stderr, "Invalid frame rate, must be 1-%d\n", LIGHTBAR_MAX_FPS);
+        return 2;
+    }
+    if (argc < 1) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 2;
+    }
+
+    struct lightbar_animation a;
+    memset(&a, 0, sizeof(a));
+    if (!strcmp(argv[0], "rainbow") && argc <= 2) {
+        a.rainbow = true;
+        a.loop = true;
+        a.period = argc == 2 ? strtod(argv[1], NULL) : 5;
+    } else if (!strcmp(argv[0], "breathe") && (argc == 4 || argc == 5)) {
+        double period = argc == 5 ? strtod(argv[4], NULL) : 3;
+        uint8_t red = atoi_x(argv[1]), green = atoi_x(argv[2]), blue = atoi_x(argv[3]);
+        a.loop = true;
+        lightbar_add_keyframe(&a, 0, 0, 0, 0, LIGHTBAR_EASING_LINEAR);
+        lightbar_add_keyframe(&a, period / 2, red, green, blue, LIGHTBAR_EASING_IN_OUT);
+        lightbar_add_keyframe(&a, period, 0, 0, 0, LIGHTBAR_EASING_IN_OUT);
+    } else if (!strcmp(argv[0], "fade") && (argc == 7 || argc == 8)) {
+        double time = argc == 8 ? strtod(argv[7], NULL) : 1;
+        lightbar_add_keyframe(&a, 0, atoi_x(argv[1]), atoi_x(argv[2]), atoi_x(argv[3]), LIGHTBAR_EASING_LINEAR);
+        lightbar_add_keyframe(&a, time, atoi_x(argv[4]), atoi_x(argv[5]), atoi_x(argv[6]), LIGHTBAR_EASING_IN_OUT);
+    } else if (!strcmp(argv[0], "keyframes") && argc == 2) {
+        a.loop = true;
+        if (!lightbar_load_keyframes(&a, argv[1])) {
+            return 2;
+        }
+    } else {
+        fprintf(stderr, "Invalid arguments\n");
+        return 2;
+    }
+    if (a.period <= 0) {
+        fprintf(stderr, "Invalid period\n");
+        return 2;
+    }
+
+    return command_lightbar_animate(ds, &a, fps, duration);
+}
+
+static int command_led_brightness(struct dualsense *ds, uint8_t number)
+{
+    if (number > 2) {
+        fprintf(stderr, "Invalid brightness level\n");
+        return 1;
+    }
+
+    ds->state.valid_flag2 |= DS_OUTPUT_VALID_FLAG2_LED_BRIGHTNESS_CONTROL_ENABLE;
+    ds->state.led_brightness = number;
+
+    return 0;
+}
+
+static int command_player_leds(struct dualsense *ds, uint8_t number, bool instant)
+{
+    static const int player_ids[] = {
+        0,
+        BIT(2),
+        BIT(3) | BIT(1),
+        BIT(4) | BIT(2) | BIT(0),
+        BIT(4) | BIT(3) | BIT(1) | BIT(0),
+        BIT(4) | BIT(3) | BIT(2) | BIT(1) | BIT(0),
+        BIT(4) | BIT(0),
+        BIT(3) | BIT(2) | BIT(1),
+    };
+
+    if (number >= sizeof(player_ids)/sizeof(*player_ids)) {
+        fprintf(stderr, "Invalid player number\n");
+        return 1;
+    }
+
+    ds->state.valid_flag1 |= DS_OUTPUT_VALID_FLAG1_PLAYER_INDICATOR_CONTROL_ENABLE;
+    ds->state.player_leds = player_ids[number] | (instant << 5);
+
+    return 0;
+}
+
+static int command_microphone(struct dualsense *ds, char *state)
+{
+    if (!strcmp(state, "on")) {
+        ds->state.power_save_control &= ~DS_OUTPUT_POWER_SAVE_CONTROL_MIC_MUTE;
+    } else if (!strcmp(state, "off")) {
+        ds->state.power_save_control |= DS_OUTPUT_POWER_SAVE_CONTROL_MIC_MUTE;
+    } else {
+        fprintf(stderr, "Invalid state\n");
+        return 1;
+    }
+
+    ds->state.valid_flag1 |= DS_OUTPUT_VALID_FLAG1_POWER_SAVE_CONTROL_ENABLE;
+
+    return 0;
+}
+
+static int command_microphone_led(struct dualsense *ds, char *state)
+{
+    if (!strcmp(state, "on")) {
+        ds->state.mute_button_led = 1;
+    } else if (!strcmp(state, "off")) {
+        ds->state.mute_button_led = 0;
+    } else if (!strcmp(state, "pulse")) {
+        ds->state.mute_button_led = 2;
+    } else {
+        fprintf(stderr, "Invalid state\n");
+        return 1;
+    }
+
+    ds->state.valid_flag1 |= DS_OUTPUT_VALID_FLAG1_MIC_MUTE_LED_CONTROL_ENABLE;
+
+    return 0;
+}
+
+static int command_microphone_mode(struct dualsense *ds, char *state)
+{
+    uint8_t path;
+    if (!strcmp(state, "chat")) {
+        path = 1;
+    } else if (!strcmp(state, "asr")) {
+        path = 2;
+    } else if (!strcmp(state, "both")) {
+        path = 0;
+    } else {
+        fprintf(stderr, "Invalid state\n");
+        return 1;
+    }
+
+    ds->state.valid_flag0 |= DS_OUTPUT_VALID_FLAG0_AUDIO_CONTROL_ENABLE;
+    ds->state.audio_flags &= ~(3 << DS_OUTPUT_AUDIO_INPUT_PATH_SHIFT);
+    ds->state.audio_flags |= path << DS_OUTPUT_AUDIO_INPUT_PATH_SHIFT;
+
+    return 0;
+}
+
+static int command_speaker(struct dualsense *ds, char *state)
+{
+    /* value
+     * | /left headphone
+     * | | / right headphone
+     * | | | / internal speaker
+     * 0 L_R_X
+     * 1 L_L_X
+     * 2 L_L_R
+     * 3 X_X_R
+     */
+    uint8_t path;
+    if (!strcmp(state, "internal")) { /* right channel to speaker */
+        path = 3;
+    } else if (!strcmp(state, "headphone")) { /* stereo channel to headphone */
+        path = 0;
+    } else if (!strcmp(state, "monoheadphone")) { /* left channel to headphone */
+        path = 1;
+    } else if (!strcmp(state, "both")) { /* left channel to headphone, right channel to speaker */
+        path = 2;
+    } else {
+        fprintf(stderr, "Invalid state\n");
+        return 1;
+    }
+
+    ds->state.valid_flag0 |= DS_OUTPUT_VALID_FLAG0_AUDIO_CONTROL_ENABLE;
+    ds->state.audio_flags &= ~(3 << DS_OUTPUT_AUDIO_OUTPUT_PATH_SHIFT);
+    ds->state.audio_flags |= path << DS_OUTPUT_AUDIO_OUTPUT_PATH_SHIFT;
+
+    return 0;
+}
+
+static int command_volume(struct dualsense *ds, uint8_t volume, const char *output)
+{
+    uint8_t max_volume = 255;
+    bool headphone = !output || !strcmp(output, "headphone");
+    bool speaker = !output || !strcmp(output, "speaker");
+
+    if (!headphone && !speaker) {
+        fprintf(stderr, "Invalid output\n");
+        return 1;
+    }
+
+    if (headphone) {
+        ds->state.valid_flag0 |= DS_OUTPUT_VALID_FLAG0_HEADPHONE_VOLUME_ENABLE;
+        ds->state.headphone_audio_volume = volume * 0x7f / max_volume;
+    }
+
+    if (speaker) {
+        ds->state.valid_flag0 |= DS_OUTPUT_VALID_FLAG0_SPEAKER_VOLUME_ENABLE;
+        /* the PS5 use 0x3d-0x64 trying over 0x64 doesnt change but below 0x3d can still lower the volume */
+        ds->state.speaker_audio_volume = volume * 0x64 / max_volume;
+    }
+
+    /* if we want to set speaker pre gain */
+    //ds->state.valid_flag1 |= DS_OUTPUT_VALID_FLAG1_AUDIO_CONTROL2_ENABLE;
+    //ds->state.audio_flags2 = 4;
+
+    return 0;
+}
+
+/* Negative attenuation keeps the current value. */
+static int command_vibration_attenuation(struct dualsense *ds, int rumble_attenuation, int trigger_attenuation)
+{
+    if (rumble_attenuation < 0) {
+        rumble_attenuation = ds->state.reduce_motor_power & 0x07;
+    }
+    if (trigger_attenuation < 0) {
+        trigger_attenuation = (ds->state.reduce_motor_power >> 4) & 0x07;
+    }
+
+    ds->state.valid_flag1 |= DS_OUTPUT_VALID_FLAG1_VIBRATION_ATTENUATION_ENABLE;
+    ds->state.reduce_motor_power = (uint8_t)((rumble_attenuation & 0x07) | ((trigger_attenuation & 0x07) << 4 ));
+
+    return 0;
+}
+
+#define TRIGGER_EFFECT_SIZE 11 /* Motor mode and 10 parameter bytes */
+
+/* Sets a packed effect, laid out like the *_trigger_motor_mode and *_trigger_param fields. */
+static int trigger_set_effect(struct dualsense *ds, const char *trigger, const uint8_t effect[TRIGGER_EFFECT_SIZE])
+{
+    if (!strcmp(trigger, "right") || !strcmp(trigger, "both")) {
+        ds->state.valid_flag0 |= DS_OUTPUT_VALID_FLAG0_RIGHT_TRIGGER_MOTOR_ENABLE;
+        ds->state.right_trigger_motor_mode = effect[0];
+        memcpy(ds->state.right_trigger_param, effect + 1, sizeof(ds->state.right_trigger_param));
+    }
+    if (!strcmp(trigger, "left") || !strcmp(trigger, "both")) {
+        ds->state.valid_flag0 |= DS_OUTPUT_VALID_FLAG0_LEFT_TRIGGER_MOTOR_ENABLE;
+        ds->state.left_trigger_motor_mode = effect[0];
+        memcpy(ds->state.left_trigger_param, effect + 1, sizeof(ds->state.left_trigger_param));
+    }
+
+    return 0;
+}
+
+static int command_trigger(struct dualsense *ds, char *trigger, uint8_t mode, uint8_t param1, uint8_t param2, uint8_t param3, uint8_t param4, uint8_t param5, uint8_t param6, uint8_t param7, uint8_t param8, uint8_t param9 )
+{
+    const uint8_t effect[TRIGGER_EFFECT_SIZE] = { mode, param1, param2, param3, param4, param5, param6, param7, param8, param9, 0 };
+    return trigger_set_effect(ds, trigger, effect);
+}
+
+static int command_trigger_off(struct dualsense *ds, char *trigger)
+{
+    return command_trigger(ds, trigger, DS_TRIGGER_EFFECT_OFF, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+}
+
+static int trigger_bitpacking_array(struct dualsense *ds, char *trigger, uint8_t mode, uint8_t strength[10], uint8_t frequency)
+{
+    uint32_t strength_zones = 0;
+    uint16_t active_zones = 0;
+    for (int i = 0; i < 10; i++) {
+        if (strength[i] > 8) {
+            fprintf(stderr, "strengths must be between 0 and 8\n");
+            return 1;
+        }
+        if (strength[i] > 0) {
+            uint8_t strength_value = (uint8_t)((strength[i] -1) & 0x07);
+            strength_zones |= (uint32_t)(strength_value << (3 * i));
+            active_zones |= (uint16_t)(1 << i);
+        }
+    }
+
+    return command_trigger(ds, trigger, mode,
+                           (uint8_t)((active_zones >> 0) & 0xff),
+                           (uint8_t)((active_zones >> 8) & 0xff),
+                           (uint8_t)((strength_zones >> 0) & 0xff),
+                           (uint8_t)((strength_zones >> 8) & 0xff),
+                           (uint8_t)((strength_zones >> 16) & 0xff),
+                           (uint8_t)((strength_zones >> 24) & 0xff),
+                           0, 0,
+                           frequency);
+}
+
+static int command_trigger_feedback(struct dualsense *ds, char *trigger, uint8_t position, uint8_t strength)
+{
+    if (position > 9) {
+        fprintf(stderr, "position must be between 0 and 9\n");
+        return 1;
+    }
+    if (strength > 8 || !(strength > 0)) {
+        fprintf(stderr, "strength must be between 1 and 8\n");
+        return 1;
+    }
+    uint8_t strength_array[10] = {0};
+    for (int i = position; i < 10; i++) {
+        strength_array[i] = strength;
+    }
+
+    return trigger_bitpacking_array(ds, trigger, DS_TRIGGER_EFFECT_FEEDBACK, strength_array, 0);
+}
+
+static int command_trigger_weapon(struct dualsense *ds, char *trigger, uint8_t start_position, uint8_t end_position, uint8_t strength)
+{
+    if (start_position > 7 || start_position < 2) {
+        fprintf(stderr, "start position must be between 2 and 7\n");
+        return 1;
+    }
+    if (end_position > 8 || end_position < start_position+1) {
+        fprintf(stderr, "end position must be between start position+1 and 8\n");
+        return 1;
+    }
+    if (strength > 8 || !(strength > 0)) {
+        fprintf(stderr, "strength must be between 1 and 8\n");
+        return 1;
+    }
+
+    uint16_t start_stop_zones = (uint16_t)((1 << start_position) | (1 << end_position));
+    return command_trigger(ds, trigger, DS_TRIGGER_EFFECT_WEAPON,
+                           (uint8_t)((start_stop_zones >> 0) & 0xff),
+                           (uint8_t)((start_stop_zones >> 8) & 0xff),
+                           strength-1,
+                           0, 0, 0, 0, 0, 0);
+}
+
+static int command_trigger_bow(struct dualsense *ds, char *trigger, uint8_t start_position, uint8_t end_position, uint8_t strength, uint8_t snap_force)
+{
+    if (start_position > 8 || !(start_position > 0)) {
+        fprintf(stderr, "start position must be between 0 and 8\n");
+        return 1;
     }
     if (end_position > 8 || end_position < start_position+1) {
         fprintf(stderr, "end position must be between start position+1 and 8\n");
         return 1;
     }
-    if (strength > 8 || !(strength > 0)) {
-        fprintf(stderr, "strength must be between 1 and 8\n");
-        return 1;
+    if (strength > 8 || !(strength > 0)) {
+        fprintf(stderr, "strength must be between 1 and 8\n");
+        return 1;
+    }
+    if (snap_force > 8 || !(snap_force > 0)) {
+        fprintf(stderr, "snap_force must be between 1 and 8\n");
+        return 1;
+    }
+
+    uint16_t start_stop_zones = (uint16_t)((1 << start_position) | (1 << end_position));
+    uint32_t force_pair =  (uint16_t)(((strength -1) & 0x07) | (((snap_force -1 ) & 0x07) << 3 ));
+    return command_trigger(ds, trigger, DS_TRIGGER_EFFECT_BOW,
+                           (uint8_t)((start_stop_zones >> 0) & 0xff),
+                           (uint8_t)((start_stop_zones >> 8) & 0xff),
+                           (uint8_t)((force_pair >> 0) & 0xff),
+                           0, 0, 0, 0, 0, 0);
+}
+
+static int command_trigger_galloping(struct dualsense *ds, char *trigger, uint8_t start_position, uint8_t end_position, uint8_t first_foot, uint8_t second_foot, uint8_t frequency)
+{
+    if (start_position > 8) {
+        fprintf(stderr, "start position must be between 0 and 8\n");
+        return 1;
+    }
+    if (end_position > 9 || end_position < start_position+1) {
+        fprintf(stderr, "end position must be between start position+1 and 9\n");
+        return 1;
+    }
+    if (first_foot > 6) {
+        fprintf(stderr, "first_foot must be between 0 and 8\n");
+        return 1;
+    }
+    if (second_foot > 7 || second_foot < first_foot+1) {
+        fprintf(stderr, "second_foot must be between first_foot+1 and 8\n");
+        return 1;
+    }
+
+    if (!(frequency > 0)) {
+        fprintf(stderr, "frequency must be greater than 0\n");
+        return 1;
+    }
+    if (frequency > 8) {
+        fprintf(stdout, "frequency has a better effect when lower than 8\n");
+    }
+    uint16_t start_stop_zones = (uint16_t)((1 << start_position) | (1 << end_position));
+    uint32_t ratio =  (uint16_t)((second_foot & 0x07) | ((first_foot & 0x07) << 3 ));
+    return command_trigger(ds, trigger, DS_TRIGGER_EFFECT_GALLOPING,
+                           (uint8_t)((start_stop_zones >> 0) & 0xff),
+                           (uint8_t)((start_stop_zones >> 8) & 0xff),
+                           (uint8_t)((ratio >> 0) & 0xff),
+                           frequency,
+                           0, 0, 0, 0, 0);
+}
+
+static int command_trigger_machine(struct dualsense *ds, char *trigger, uint8_t start_position, uint8_t end_position, uint8_t strength_a, uint8_t strength_b, uint8_t frequency, uint8_t period)
+{
+    // if start_position == 0 nothing happen
+    if (start_position > 8 || !(start_position > 0)) {
+        fprintf(stderr, "start position must be between 1 and 8\n");
+        return 1;
+    }
+    if (end_position > 9 || end_position < start_position+1) {
+        fprintf(stderr, "end position must be between start position+1 and 9\n");
+        return 1;
+    }
+    if (strength_a > 7) {
+        fprintf(stderr, "strength_a position must be between 0 and 7\n");
+        return 1;
+    }
+    if (strength_b > 7) {
+        fprintf(stderr, "strength_b position must be between 0 and 7\n");
+        return 1;
+    }
+    if (!(frequency > 0)) {
+        fprintf(stderr, "frequency must be greater than 0\n");
+        return 1;
+    }
+    uint16_t start_stop_zones = (uint16_t)((1 << start_position) | (1 << end_position));
+    uint32_t force_pair =  (uint16_t)((strength_a & 0x07) | ((strength_b & 0x07) << 3 ));
+    return command_trigger(ds, trigger, DS_TRIGGER_EFFECT_MACHINE,
+                           (uint8_t)((start_stop_zones >> 0) & 0xff),
+                           (uint8_t)((start_stop_zones >> 8) & 0xff),
+                           (uint8_t)((force_pair >> 0) & 0xff),
+                           frequency,
+                           period,
+                           0, 0, 0, 0);
+}
+
+static int command_trigger_vibration(struct dualsense *ds, char *trigger, uint8_t position, uint8_t amplitude, uint8_t frequency)
+{
+    if (position > 9) {
+        fprintf(stderr, "position must be between 0 and 9\n");
+        return 1;
+    }
+    if (amplitude > 8 || !(amplitude > 0)) {
+        fprintf(stderr, "amplitude must be between 1 and 8\n");
+        return 1;
+    }
+    if (!(frequency > 0)) {
+        fprintf(stderr, "frequency must be greater than 0\n");
+        return 1;
+    }
+
+    uint8_t strength_array[10] = {0};
+    for (int i = position; i < 10; i++) {
+        strength_array[i] = amplitude;
+    }
+    return trigger_bitpacking_array(ds, trigger, DS_TRIGGER_EFFECT_VIBRATION, strength_array, frequency);
+
+}
+
+static int command_trigger_feedback_raw(struct dualsense *ds, char *trigger, uint8_t strength[10] )
+{
+    return trigger_bitpacking_array(ds, trigger, DS_TRIGGER_EFFECT_FEEDBACK, strength, 0);
+}
+
+static int command_trigger_vibration_raw(struct dualsense *ds, char *trigger, uint8_t strength[10], uint8_t frequency)
+{
+    return trigger_bitpacking_array(ds, trigger, DS_TRIGGER_EFFECT_VIBRATION, strength, frequency);
+}
+
+/*
+ * Compiled profile file: a fixed size header followed by one record per
+ * profile holding complete output reports for USB and BT, as produced by
+ * profile compile. Applying a profile only sets the BT sequence number and CRC.
+ */
+#define DS_PROFILE_MAGIC "DSPROF\0\0"
+#define DS_PROFILE_VERSION 1
+#define DS_PROFILE_NAME_SIZE 32
+
+struct dualsense_profile_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint8_t reserved[12];
+} __attribute__((packed));
+_Static_assert(sizeof(struct dualsense_profile_header) == 32, "Bad profile header size");
+
+struct dualsense_profile {
+    char name[DS_PROFILE_NAME_SIZE];
+    uint8_t usb[DS_OUTPUT_REPORT_USB_SIZE];
+    uint8_t bt[DS_OUTPUT_REPORT_BT_SIZE];
+    uint8_t reserved[3];
+} __attribute__((packed));
+_Static_assert(sizeof(struct dualsense_profile) % 8 == 0, "Bad profile record size");
+
+struct dualsense_profile_file {
+    void *map;
+    size_t map_size;
+    const struct dualsense_profile *profiles;
+    size_t count;
+};
+
+static bool dualsense_profile_file_open(struct dualsense_profile_file *pf, const char *path)
+{
+    memset(pf, 0, sizeof(*pf));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct dualsense_profile_header)) {
+        fprintf(stderr, "Invalid profile file %s\n", path);
+        close(fd);
+        return false;
+    }
+    pf->map_size = st.st_size;
+    pf->map = mmap(NULL, pf->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pf->map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    const struct dualsense_profile_header *header = pf->map;
+    if (memcmp(header->magic, DS_PROFILE_MAGIC, sizeof(header->magic)) ||
+        header->version != DS_PROFILE_VERSION ||
+        header->header_size != sizeof(struct dualsense_profile_header) ||
+        header->record_size != sizeof(struct dualsense_profile) ||
+        (pf->map_size - header->header_size) % header->record_size) {
+        fprintf(stderr, "Invalid profile file %s\n", path);
+        munmap(pf->map, pf->map_size);
+        return false;
+    }
+    pf->profiles = (const struct dualsense_profile *)((const uint8_t *)pf->map + header->header_size);
+    pf->count = (pf->map_size - header->header_size) / header->record_size;
+    return true;
+}
+
+static void dualsense_profile_file_close(struct dualsense_profile_file *pf)
+{
+    munmap(pf->map, pf->map_size);
+}
+
+/* Profile with the given name, or the first one if name is NULL. */
+static const struct dualsense_profile *dualsense_profile_find(const struct dualsense_profile_file *pf, const char *name)
+{
+    for (size_t i = 0; i < pf->count; ++i) {
+        if (!name || !strncmp(pf->profiles[i].name, name, DS_PROFILE_NAME_SIZE)) {
+            return &pf->profiles[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Sends the precompiled report of a profile, bypassing the section diffing of
+ * dualsense_flush() but not the rate limit.
+ */
+static bool dualsense_apply_profile(struct dualsense *ds, const struct dualsense_profile *profile)
+{
+    if (!dualsense_flush(ds)) {
+        return false;
+    }
+
+    struct dualsense_output_report rp;
+    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
+    rp.data = rbuf;
+    if (ds->bt) {
+        memcpy(rbuf, profile->bt, sizeof(profile->bt));
+        rp.len = sizeof(profile->bt);
+        rp.bt = (struct dualsense_output_report_bt *)rbuf;
+        rp.usb = NULL;
+        rp.common = &rp.bt->common;
+        rp.bt->seq_tag = ds->output_seq;
+        if (++ds->output_seq == 16)
+            ds->output_seq = 0;
+    } else {
+        memcpy(rbuf, profile->usb, sizeof(profile->usb));
+        rp.len = sizeof(profile->usb);
+        rp.bt = NULL;
+        rp.usb = (struct dualsense_output_report_usb *)rbuf;
+        rp.common = &rp.usb->common;
+    }
+
+    uint64_t now = dualsense_output_slot(ds, true);
+    if (!dualsense_send_output_report(ds, &rp)) {
+        return false;
+    }
+    ds->sent = *rp.common;
+    dualsense_discard(ds);
+    ds->last_output = now;
+    ds->reports_requested++;
+    ds->reports_sent++;
+    return true;
+}
+
+static int command_profile_apply(struct dualsense *ds, const char *path, const char *name)
+{
+    struct dualsense_profile_file pf;
+    if (!dualsense_profile_file_open(&pf, path)) {
+        return 2;
+    }
+    int ret = 0;
+    const struct dualsense_profile *profile = dualsense_profile_find(&pf, name);
+    if (!profile) {
+        fprintf(stderr, "No profile '%s' in %s\n", name ? name : "", path);
+        ret = 2;
+    } else if (!dualsense_apply_profile(ds, profile)) {
+        ret = 2;
+    }
+    dualsense_profile_file_close(&pf);
+    return ret;
+}
+
+extern char **environ;
+
+#define MONITOR_QUEUE_SIZE 64
+#define MONITOR_MAX_ARGS 32
+
+static bool sh_command_wait = false;
+static bool sh_command_exec = false;
+static int sh_command_jobs = 4;
+static const char *sh_command_add = NULL;
+static const char *sh_command_remove = NULL;
+static const char *sh_command_reconnect = NULL;
+static int monitor_debounce_ms = 500;
+
+/*
+ * Hooks are spawned directly from the monitor, at most sh_command_jobs at a
+ * time. Events arriving while all slots are busy wait in a bounded queue and
+ * finished hooks are reaped from the poll loop through a signalfd.
+ */
+struct monitor_job {
+    const char *command;
+    char serial_number[18];
+};
+
+struct monitor_pool {
+    struct monitor_job queue[MONITOR_QUEUE_SIZE];
+    int head;
+    int queued;
+    int running;
+    char **envp; /* environ with a DS_DEV slot at index 0 */
+    char dev_env[32];
+    posix_spawnattr_t attr;
+};
+
+static struct monitor_pool monitor_pool;
+
+static bool monitor_pool_init(struct monitor_pool *pool)
+{
+    size_t count = 0;
+    while (environ[count]) {
+        count++;
+    }
+    pool->envp = calloc(count + 2, sizeof(*pool->envp));
+    if (!pool->envp) {
+        perror("calloc");
+        return false;
+    }
+    pool->envp[0] = pool->dev_env;
+    for (size_t i = 0, n = 1; i < count; ++i) {
+        if (strncmp(environ[i], "DS_DEV=", 7)) {
+            pool->envp[n++] = environ[i];
+        }
+    }
+
+    /* SIGCHLD is blocked in the monitor for the signalfd, hooks get a clean mask */
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_init(&pool->attr);
+    posix_spawnattr_setsigmask(&pool->attr, &mask);
+    posix_spawnattr_setflags(&pool->attr, POSIX_SPAWN_SETSIGMASK);
+    return true;
+}
+
+static void monitor_pool_spawn(struct monitor_pool *pool, const struct monitor_job *job)
+{
+    char buf[PATH_MAX];
+    char *argv[MONITOR_MAX_ARGS + 1];
+    if (sh_command_exec) {
+        /* Split on whitespace, no quoting or expansion */
+        snprintf(buf, sizeof(buf), "%s", job->command);
+        int argc = 0;
+        for (char *arg = strtok(buf, " \t"); arg && argc < MONITOR_MAX_ARGS; arg = strtok(NULL, " \t")) {
+            argv[argc++] = arg;
+        }
+        argv[argc] = NULL;
+        if (!argc) {
+            return;
+        }
+    } else {
+        argv[0] = "sh";
+        argv[1] = "-c";
+        argv[2] = (char *)job->command;
+        argv[3] = NULL;
+    }
+
+    snprintf(pool->dev_env, sizeof(pool->dev_env), "DS_DEV=%s", job->serial_number);
+    pid_t pid;
+    int err = sh_command_exec ? posix_spawnp(&pid, argv[0], NULL, &pool->attr, argv, pool->envp)
+                              : posix_spawn(&pid, "/bin/sh", NULL, &pool->attr, argv, pool->envp);
+    if (err) {
+        fprintf(stderr, "Failed to run %s: %s\n", argv[0], strerror(err));
+        return;
+    }
+    pool->running++;
+}
+
+static void monitor_pool_start(struct monitor_pool *pool)
+{
+    while (pool->queued && pool->running < sh_command_jobs) {
+        monitor_pool_spawn(pool, &pool->queue[pool->head]);
+        pool->head = (pool->head + 1) % MONITOR_QUEUE_SIZE;
+        pool->queued--;
+    }
+}
+
+static void run_sh_command(const char *command, const char *serial_number)
+{
+    struct monitor_pool *pool = &monitor_pool;
+    if (pool->queued == MONITOR_QUEUE_SIZE) {
+        fprintf(stderr, "Too many pending commands, dropping event for %s\n", serial_number);
+        return;
+    }
+    struct monitor_job *job = &pool->queue[(pool->head + pool->queued) % MONITOR_QUEUE_SIZE];
+    job->command = command;
+    snprintf(job->serial_number, sizeof(job->serial_number), "%.17s", serial_number);
+    pool->queued++;
+    monitor_pool_start(pool);
+}
+
+static void monitor_pool_reap(struct monitor_pool *pool, int signal_fd)
+{
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        /* Drain, one signal may stand for several exited children */
+    }
+    int status;
+    while (waitpid(-1, &status, WNOHANG) > 0) {
+        pool->running--;
+    }
+    monitor_pool_start(pool);
+}
+
+/*
+ * Identifies DualSense event devices from the properties udev already has in
+ * memory: the event itself carries ID_INPUT_JOYSTICK and the parent input
+ * device carries PRODUCT (bus/vendor/product/version) and the quoted UNIQ.
+ */
+static bool check_dualsense_device(struct udev_device *dev, char serial_number[18])
+{
+    const char *sysname = udev_device_get_sysname(dev);
+    if (!sysname || strncmp(sysname, "event", 5)) {
+        return false;
+    }
+
+    const char *joystick = udev_device_get_property_value(dev, "ID_INPUT_JOYSTICK");
+    if (!joystick || strcmp(joystick, "1")) {
+        return false;
+    }
+
+    struct udev_device *parent = udev_device_get_parent_with_subsystem_devtype(dev, "input", NULL);
+    const char *product = parent ? udev_device_get_property_value(parent, "PRODUCT") : NULL;
+    unsigned int bus, vendor, product_id;
+    if (!product || sscanf(product, "%x/%x/%x", &bus, &vendor, &product_id) != 3) {
+        return false;
+    }
+    if (vendor != DS_VENDOR_ID || (product_id != DS_PRODUCT_ID && product_id != DS_EDGE_PRODUCT_ID)) {
+        return false;
+    }
+
+    const char *uniq = udev_device_get_property_value(parent, "UNIQ");
+    if (uniq) {
+        uniq += *uniq == '"';
+        size_t len = strcspn(uniq, "\"");
+        snprintf(serial_number, 18, "%.*s", (int)(len < 17 ? len : 17), uniq);
+    }
+    return true;
+}
+
+#define MONITOR_MAX_DEVICES 32
+#define MONITOR_PROFILE_ATTEMPTS 4
+#define PROFILE_MAX_ARGS 256
+
+static int run_command(struct dualsense *ds, int argc, char *argv[]);
+
+/*
+ * Commands applied in-process to every newly connected controller. The file
+ * has one command per line as given on the command line, all lines are sent
+ * as one batch like commands joined with +. A compiled profile file applies
+ * its first profile instead.
+ */
+struct monitor_profile {
+    char *data;
+    int argc;
+    char *argv[PROFILE_MAX_ARGS];
+    /* First profile of a compiled profile file, used instead of argv if set */
+    struct dualsense_profile_file compiled;
+    const struct dualsense_profile *image;
+};
+
+static struct monitor_profile *monitor_profile = NULL;
+
+static bool monitor_profile_load(struct monitor_profile *profile, const char *path)
+{
+    char magic[8];
+    FILE *f = fopen(path, "r");
+    if (f && fread(magic, sizeof(magic), 1, f) == 1 && !memcmp(magic, DS_PROFILE_MAGIC, sizeof(magic))) {
+        fclose(f);
+        if (!dualsense_profile_file_open(&profile->compiled, path)) {
+            return false;
+        }
+        profile->image = dualsense_profile_find(&profile->compiled, NULL);
+        if (!profile->image) {
+            fprintf(stderr, "%s: no profiles\n", path);
+            dualsense_profile_file_close(&profile->compiled);
+            return false;
+        }
+        return true;
+    } else if (f) {
+        rewind(f);
+    }
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    size_t size = 0;
+    profile->data = NULL;
+    profile->argc = 0;
+    ssize_t len = getdelim(&profile->data, &size, '\0', f);
+    fclose(f);
+    if (len < 0) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        free(profile->data);
+        return false;
+    }
+
+    char *save_line;
+    for (char *line = strtok_r(profile->data, "\n", &save_line); line; line = strtok_r(NULL, "\n", &save_line)) {
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        int start = profile->argc;
+        char *save_arg;
+        for (char *arg = strtok_r(line, " \t\r", &save_arg); arg; arg = strtok_r(NULL, " \t\r", &save_arg)) {
+            if (profile->argc == PROFILE_MAX_ARGS - 1) {
+                fprintf(stderr, "%s: too many arguments\n", path);
+                free(profile->data);
+                return false;
+            }
+            if (profile->argc == start && start) {
+                profile->argv[profile->argc++] = "+";
+            }
+            profile->argv[profile->argc++] = arg;
+        }
+    }
+    if (!profile->argc) {
+        fprintf(stderr, "%s: no commands\n", path);
+        free(profile->data);
+        return false;
+    }
+    return true;
+}
+
+/* Opens the hidraw node next to an input event node without enumerating all devices. */
+static bool monitor_open_device(struct dualsense *ds, struct udev_device *event, const char *serial_number)
+{
+    bool ret = false;
+    const struct dualsense_transport *transport = dualsense_transport();
+    struct udev_device *hid = udev_device_get_parent_with_subsystem_devtype(event, "hid", NULL);
+    /* Cacheable transports open hidraw device nodes */
+    if (hid && transport->cacheable) {
+        struct udev *u = udev_device_get_udev(event);
+        struct udev_enumerate *enumerate = udev_enumerate_new(u);
+        udev_enumerate_add_match_parent(enumerate, hid);
+        udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+        udev_enumerate_scan_devices(enumerate);
+        struct udev_list_entry *entry = udev_enumerate_get_list_entry(enumerate);
+        struct udev_device *dev = entry ? udev_device_new_from_syspath(u, udev_list_entry_get_name(entry)) : NULL;
+        struct dualsense_device_info info;
+        if (dev && hidraw_device_info(dev, &info)) {
+            ret = dualsense_open(ds, transport, &info);
+        }
+        if (dev) {
+            udev_device_unref(dev);
+        }
+        udev_enumerate_unref(enumerate);
+    }
+    return ret || dualsense_init(ds, serial_number);
+}
+
+/* Returns false if the controller could not be opened, its node may not be accessible yet. */
+static bool monitor_apply_profile(struct udev_device *event, const char *serial_number)
+{
+    struct dualsense ds;
+    if (event ? !monitor_open_device(&ds, event, serial_number) : !dualsense_init(&ds, serial_number)) {
+        return false;
+    }
+    if (monitor_profile->image ? !dualsense_apply_profile(&ds, monitor_profile->image)
+                               : run_command(&ds, monitor_profile->argc, monitor_profile->argv)) {
+        fprintf(stderr, "Failed to apply profile to %s\n", serial_number);
+    }
+    dualsense_destroy(&ds);
+    return true;
+}
+
+/*
+ * Controller state seen by the monitor, keyed by MAC. Events for a MAC are
+ * collected for monitor_debounce_ms after the first one and then compared to
+ * the state the hooks last reported, so several event nodes or a flapping link
+ * fire one hook per actual change. The parent device with the MAC is usually
+ * gone by the time a remove arrives, so event nodes are also remembered by
+ * device number, which every remove event carries.
+ */
+struct monitor_device {
+    char serial_number[18];
+    int nodes;
+    bool reported;   /* Connected according to the last hook run */
+    bool bounced;    /* Disconnected at some point since the last hook run */
+    uint64_t deadline; /* Zero if nothing is pending */
+    int profile_attempts; /* Left to apply --apply-profile, zero once applied */
+    dev_t devnums[4];
+};
+
+static struct monitor_device monitor_devices[MONITOR_MAX_DEVICES];
+
+static struct monitor_device *monitor_find_device(const char *serial_number)
+{
+    for (int i = 0; i < MONITOR_MAX_DEVICES; ++i) {
+        struct monitor_device *dev = &monitor_devices[i];
+        if (dev->serial_number[0] && !strcmp(dev->serial_number, serial_number)) {
+            return dev;
+        }
+    }
+    return NULL;
+}
+
+static struct monitor_device *monitor_get_device(const char *serial_number)
+{
+    struct monitor_device *dev = monitor_find_device(serial_number);
+    if (dev) {
+        return dev;
+    }
+    struct monitor_device *free_slot = NULL;
+    for (int i = 0; i < MONITOR_MAX_DEVICES && !free_slot; ++i) {
+        dev = &monitor_devices[i];
+        if (!dev->nodes && !dev->reported && !dev->deadline) {
+            free_slot = dev;
+        }
+    }
+    if (free_slot) {
+        memset(free_slot, 0, sizeof(*free_slot));
+        snprintf(free_slot->serial_number, sizeof(free_slot->serial_number), "%s", serial_number);
+    }
+    return free_slot;
+}
+
+static void monitor_schedule(struct monitor_device *dev)
+{
+    if (!dev->deadline) {
+        dev->deadline = monotonic_ns() + (uint64_t)monitor_debounce_ms * 1000000;
+    }
+}
+
+static void monitor_try_profile(struct monitor_device *mdev, struct udev_device *event)
+{
+    if (monitor_apply_profile(event, mdev->serial_number)) {
+        mdev->profile_attempts = 0;
+    } else if (--mdev->profile_attempts == 0) {
+        fprintf(stderr, "Failed to apply profile to %s\n", mdev->serial_number);
+    }
+}
+
+static void add_device(struct udev_device *dev)
+{
+    char serial_number[18] = "00:00:00:00:00:00";
+    if (!check_dualsense_device(dev, serial_number)) {
+        return;
+    }
+    struct monitor_device *mdev = monitor_get_device(serial_number);
+    if (!mdev) {
+        fprintf(stderr, "Too many controllers, ignoring %s\n", serial_number);
+        return;
+    }
+    dev_t devnum = udev_device_get_devnum(dev);
+    for (size_t i = 0; i < sizeof(mdev->devnums) / sizeof(*mdev->devnums); ++i) {
+        if (mdev->devnums[i] == devnum) {
+            return;
+        }
+    }
+    for (size_t i = 0; i < sizeof(mdev->devnums) / sizeof(*mdev->devnums); ++i) {
+        if (!mdev->devnums[i]) {
+            mdev->devnums[i] = devnum;
+            break;
+        }
+    }
+    /*
+     * Applied right away, a reconnected controller has lost its settings
+     * anyway. Retried after the debounce window if the hidraw node cannot be
+     * opened yet, udev rules may not have set its permissions.
+     */
+    if (!mdev->nodes++ && monitor_profile) {
+        mdev->profile_attempts = MONITOR_PROFILE_ATTEMPTS;
+        monitor_try_profile(mdev, dev);
+    }
+    monitor_schedule(mdev);
+}
+
+static void monitor_remove_node(struct monitor_device *mdev, size_t node)
+{
+    mdev->devnums[node] = 0;
+    if (--mdev->nodes == 0) {
+        mdev->bounced = true;
+    }
+    monitor_schedule(mdev);
+}
+
+static void remove_device(struct udev_device *dev)
+{
+    dev_t devnum = udev_device_get_devnum(dev);
+    char serial_number[18] = "";
+    struct monitor_device *mdev = NULL;
+    if (check_dualsense_device(dev, serial_number) && serial_number[0]) {
+        mdev = monitor_find_device(serial_number);
+    }
+
+    for (int i = 0; i < MONITOR_MAX_DEVICES; ++i) {
+        struct monitor_device *m = &monitor_devices[i];
+        if (mdev && m != mdev) {
+            continue;
+        }
+        for (size_t j = 0; devnum && j < sizeof(m->devnums) / sizeof(*m->devnums); ++j) {
+            if (m->devnums[j] == devnum) {
+                monitor_remove_node(m, j);
+                return;
+            }
+        }
+    }
+
+    /* Known controller but a node it was not added under, drop all of them */
+    if (mdev && mdev->nodes) {
+        memset(mdev->devnums, 0, sizeof(mdev->devnums));
+        mdev->nodes = 0;
+        mdev->bounced = true;
+        monitor_schedule(mdev);
+    }
+}
+
+/* Runs hooks for devices whose window ended by now, returns the next deadline or 0. */
+static uint64_t monitor_fire_due(uint64_t now)
+{
+    uint64_t next = 0;
+    for (int i = 0; i < MONITOR_MAX_DEVICES; ++i) {
+        struct monitor_device *dev = &monitor_devices[i];
+        if (!dev->deadline) {
+            continue;
+        } else if (dev->deadline > now) {
+            next = next && next < dev->deadline ? next : dev->deadline;
+            continue;
+        }
+
+        bool connected = dev->nodes > 0;
+        if (!connected) {
+            dev->profile_attempts = 0;
+        } else if (dev->profile_attempts) {
+            monitor_try_profile(dev, NULL);
+        }
+        const char *command = NULL;
+        if (connected && !dev->reported) {
+            command = sh_command_add;
+        } else if (!connected && dev->reported) {
+            command = sh_command_remove;
+        } else if (connected && dev->bounced) {
+            command = sh_command_reconnect ? sh_command_reconnect : sh_command_add;
+        }
+        if (command) {
+            run_sh_command(command, dev->serial_number);
+        }
+        dev->reported = connected;
+        dev->bounced = false;
+        dev->deadline = 0;
+        if (dev->profile_attempts) {
+            monitor_schedule(dev);
+            next = next && next < dev->deadline ? next : dev->deadline;
+        }
+    }
+    return next;
+}
+
+/* Fires due hooks and returns the poll timeout until the next deadline. */
+static int monitor_poll_timeout(void)
+{
+    uint64_t now = monotonic_ns();
+    uint64_t next = monitor_fire_due(now);
+    if (!next) {
+        return -1;
+    }
+    /* Round up so the window has ended when poll returns */
+    return (next - now + 999999) / 1000000;
+}
+
+static int command_monitor(void)
+{
+    if (sh_command_wait) {
+        sh_command_jobs = 1;
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        perror("signalfd");
+        return 2;
+    }
+    if (!monitor_pool_init(&monitor_pool)) {
+        close(signal_fd);
+        return 2;
+    }
+
+    struct udev *u = udev_new();
+    struct udev_enumerate *enumerate = udev_enumerate_new(u);
+    udev_enumerate_add_match_subsystem(enumerate, "input");
+    udev_enumerate_add_match_sysname(enumerate, "event*");
+    udev_enumerate_add_match_property(enumerate, "ID_INPUT_JOYSTICK", "1");
+    udev_enumerate_scan_devices(enumerate);
+    struct udev_list_entry *devices = udev_enumerate_get_list_entry(enumerate);
+    struct udev_list_entry *dev_list_entry;
+    udev_list_entry_foreach(dev_list_entry, devices) {
+        const char *path = udev_list_entry_get_name(dev_list_entry);
+        struct udev_device *dev = udev_device_new_from_syspath(u, path);
+        add_device(dev);
+        udev_device_unref(dev);
+    }
+    udev_enumerate_unref(enumerate);
+    /* Controllers present at startup need no debouncing */
+    monitor_fire_due(UINT64_MAX);
+
+    struct udev_monitor *monitor = udev_monitor_new_from_netlink(u, "udev");
+    udev_monitor_filter_add_match_subsystem_devtype(monitor, "input", NULL);
+    udev_monitor_enable_receiving(monitor);
+
+    struct pollfd fds[2];
+    fds[0].fd = udev_monitor_get_fd(monitor);
+    fds[0].events = POLLIN;
+    fds[1].fd = signal_fd;
+    fds[1].events = POLLIN;
+
+    /* Profiles that could not be applied yet have a retry pending */
+    int timeout = monitor_poll_timeout();
+    while (1) {
+        int ret = poll(fds, 2, timeout);
+        if (ret < 0) {
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            monitor_pool_reap(&monitor_pool, signal_fd);
+        }
+        timeout = monitor_poll_timeout();
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        struct udev_device *dev = udev_monitor_receive_device(monitor);
+        if (!dev) {
+            continue;
+        }
+        if (!strcmp(udev_device_get_action(dev), "add")) {
+            add_device(dev);
+        } else if (!strcmp(udev_device_get_action(dev), "remove")) {
+            remove_device(dev);
+        }
+        udev_device_unref(dev);
+        timeout = monitor_poll_timeout();
+    }
+
+    udev_monitor_unref(monitor);
+    udev_unref(u);
+    posix_spawnattr_destroy(&monitor_pool.attr);
+    free(monitor_pool.envp);
+    close(signal_fd);
+
+    return 0;
+}
+
+/*
+ * Trigger effect library file: a fixed size header, an open addressing hash
+ * table of record index + 1 (0 for empty slots) keyed by the FNV-1a hash of the
+ * name, and fixed size records with each effect already packed. The file is
+ * used in place through mmap, looking up an effect needs no parsing.
+ */
+#define TRIGGER_LIBRARY_MAGIC "DSFX\0\0\0\0"
+#define TRIGGER_LIBRARY_VERSION 1
+#define TRIGGER_EFFECT_NAME_SIZE 32
+
+struct trigger_library_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t count;
+    uint32_t table_size; /* Power of two */
+    uint8_t reserved[4];
+} __attribute__((packed));
+_Static_assert(sizeof(struct trigger_library_header) == 32, "Bad trigger library header size");
+
+struct trigger_library_effect {
+    char name[TRIGGER_EFFECT_NAME_SIZE];
+    uint8_t effect[TRIGGER_EFFECT_SIZE];
+    uint8_t reserved[5];
+} __attribute__((packed));
+_Static_assert(sizeof(struct trigger_library_effect) % 8 == 0, "Bad trigger library record size");
+
+struct trigger_library {
+    void *map;
+    size_t map_size;
+    const struct trigger_library_header *header;
+    const uint32_t *table;
+    const struct trigger_library_effect *effects;
+};
+
+static uint32_t trigger_library_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < TRIGGER_EFFECT_NAME_SIZE && name[i]; ++i) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool trigger_library_open(struct trigger_library *lib, const char *path)
+{
+    memset(lib, 0, sizeof(*lib));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*lib->header)) {
+        fprintf(stderr, "Invalid trigger library %s\n", path);
+        close(fd);
+        return false;
+    }
+    lib->map_size = st.st_size;
+    lib->map = mmap(NULL, lib->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (lib->map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    lib->header = lib->map;
+    const struct trigger_library_header *h = lib->header;
+    if (memcmp(h->magic, TRIGGER_LIBRARY_MAGIC, sizeof(h->magic)) ||
+        h->version != TRIGGER_LIBRARY_VERSION ||
+        h->header_size != sizeof(struct trigger_library_header) ||
+        h->record_size != sizeof(struct trigger_library_effect) ||
+        !h->table_size || (h->table_size & (h->table_size - 1)) || h->table_size <= h->count ||
+        lib->map_size != h->header_size + (size_t)h->table_size * sizeof(uint32_t) + (size_t)h->count * h->record_size) {
+        fprintf(stderr, "Invalid trigger library %s\n", path);
+        munmap(lib->map, lib->map_size);
+        return false;
+    }
+    lib->table = (const uint32_t *)((const uint8_t *)lib->map + h->header_size);
+    lib->effects = (const struct trigger_library_effect *)(lib->table + h->table_size);
+
+    /* Every effect in exactly one slot, so the table keeps empty slots that end lookups */
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < h->table_size; ++i) {
+        if (lib->table[i] > h->count) {
+            used = UINT32_MAX;
+            break;
+        }
+        used += lib->table[i] != 0;
+    }
+    if (used != h->count) {
+        fprintf(stderr, "Invalid trigger library %s\n", path);
+        munmap(lib->map, lib->map_size);
+        return false;
+    }
+    return true;
+}
+
+static void trigger_library_close(struct trigger_library *lib)
+{
+    munmap(lib->map, lib->map_size);
+}
+
+/* Effect by name, or by index if name is a number. */
+static const struct trigger_library_effect *trigger_library_find(const struct trigger_library *lib, const char *name)
+{
+    char *end;
+    unsigned long index = strtoul(name, &end, 10);
+    if (*name && !*end) {
+        return index < lib->header->count ? &lib->effects[index] : NULL;
+    }
+
+    uint32_t mask = lib->header->table_size - 1;
+    uint32_t slot = trigger_library_hash(name) & mask;
+    for (uint32_t probes = 0; probes < lib->header->table_size; ++probes, slot = (slot + 1) & mask) {
+        uint32_t entry = lib->table[slot];
+        if (!entry || entry > lib->header->count) {
+            return NULL;
+        }
+        if (!strncmp(lib->effects[entry - 1].name, name, TRIGGER_EFFECT_NAME_SIZE)) {
+            return &lib->effects[entry - 1];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The last library used stays mapped, so a daemon or sequence using the same
+ * file does not open it again unless it was replaced. Callers hold
+ * trigger_library_lock while using the result, commands on several devices
+ * run in parallel threads.
+ */
+static pthread_mutex_t trigger_library_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct trigger_library *trigger_library_get(const char *path)
+{
+    static struct trigger_library cached;
+    static char cached_path[PATH_MAX];
+    static dev_t cached_dev;
+    static ino_t cached_ino;
+
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (cached.map && !strcmp(cached_path, path) && st.st_dev == cached_dev && st.st_ino == cached_ino) {
+        return &cached;
+    }
+    if (cached.map) {
+        trigger_library_close(&cached);
+        cached.map = NULL;
+    }
+    if (!trigger_library_open(&cached, path)) {
+        cached.map = NULL;
+        return NULL;
+    }
+    snprintf(cached_path, sizeof(cached_path), "%s", path);
+    cached_dev = st.st_dev;
+    cached_ino = st.st_ino;
+    return &cached;
+}
+
+static int command_trigger_effect(struct dualsense *ds, char *trigger, const char *path, const char *name)
+{
+    uint8_t packed[TRIGGER_EFFECT_SIZE];
+    pthread_mutex_lock(&trigger_library_lock);
+    const struct trigger_library *lib = trigger_library_get(path);
+    const struct trigger_library_effect *effect = lib ? trigger_library_find(lib, name) : NULL;
+    if (effect) {
+        memcpy(packed, effect->effect, sizeof(packed));
+    }
+    pthread_mutex_unlock(&trigger_library_lock);
+
+    if (!lib) {
+        return 2;
+    } else if (!effect) {
+        fprintf(stderr, "No effect '%s' in %s\n", name, path);
+        return 1;
+    }
+    return trigger_set_effect(ds, trigger, packed);
+}
+
+static int parse_trigger(struct dualsense *ds, int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 2;
+    }
+    if (strcmp(argv[1], "left") && strcmp(argv[1], "right") && strcmp(argv[1], "both")) {
+        fprintf(stderr, "Invalid argument: TRIGGER must be either \"left\", \"right\" or \"both\"\n");
+        return 2;
+    }
+    if (!strcmp(argv[2], "off")) {
+        return command_trigger_off(ds, argv[1]);
+    } else if (!strcmp(argv[2], "effect")) {
+        if (argc != 5) {
+            fprintf(stderr, "effect mode needs a library and an effect name or index\n");
+            return 2;
+        }
+        return command_trigger_effect(ds, argv[1], argv[3], argv[4]);
+    } else if (!strcmp(argv[2], "feedback")) {
+        if (argc < 5) {
+            fprintf(stderr, "feedback mode need two parameters\n");
+            return 2;
+        }
+        return command_trigger_feedback(ds, argv[1], atoi_x(argv[3]), atoi_x(argv[4]));
+    } else if (!strcmp(argv[2], "weapon")) {
+        if (argc < 6) {
+            fprintf(stderr, "weapons mode need three parameters\n");
+            return 2;
+        }
+        return command_trigger_weapon(ds, argv[1], atoi_x(argv[3]), atoi_x(argv[4]), atoi_x(argv[5]));
+    } else if (!strcmp(argv[2], "bow")) {
+        if (argc < 7) {
+            fprintf(stderr, "bow mode need four parameters\n");
+            return 2;
+        }
+        return command_trigger_bow(ds, argv[1], atoi_x(argv[3]), atoi_x(argv[4]), atoi_x(argv[5]), atoi_x(argv[6]));
+    } else if (!strcmp(argv[2], "galloping")) {
+        if (argc < 8) {
+            fprintf(stderr, "galloping mode need five parameters\n");
+            return 2;
+        }
+        return command_trigger_galloping(ds, argv[1], atoi_x(argv[3]), atoi_x(argv[4]), atoi_x(argv[5]), atoi_x(argv[6]), atoi_x(argv[7]));
+    } else if (!strcmp(argv[2], "machine")) {
+        if (argc < 9) {
+            fprintf(stderr, "machine mode need six parameters\n");
+            return 2;
+        }
+        return command_trigger_machine(ds, argv[1], atoi_x(argv[3]), atoi_x(argv[4]), atoi_x(argv[5]), atoi_x(argv[6]), atoi_x(argv[7]), atoi_x(argv[8]));
+    } else if (!strcmp(argv[2], "vibration")) {
+        if (argc < 6) {
+            fprintf(stderr, "vibration mode need three parameters\n");
+            return 2;
+        }
+        return command_trigger_vibration(ds, argv[1], atoi_x(argv[3]), atoi_x(argv[4]), atoi_x(argv[5]));
+    } else if (!strcmp(argv[2], "feedback-raw")) {
+        if (argc < 13) {
+            fprintf(stderr, "feedback-raw mode need ten parameters\n");
+            return 2;
+        }
+        uint8_t strengths[10] = { atoi_x(argv[3]), atoi_x(argv[4]), atoi_x(argv[5]), atoi_x(argv[6]), atoi_x(argv[7]), atoi_x(argv[8]), atoi_x(argv[9]), atoi_x(argv[10]), atoi_x(argv[11]), atoi_x(argv[12]) };
+        return command_trigger_feedback_raw(ds, argv[1], strengths);
+    } else if (!strcmp(argv[2], "vibration-raw")) {
+        if (argc < 14) {
+            fprintf(stderr, "vibration-raw mode need eleven parameters\n");
+            return 2;
+        }
+        uint8_t strengths[10] = { atoi_x(argv[3]), atoi_x(argv[4]), atoi_x(argv[5]), atoi_x(argv[6]), atoi_x(argv[7]), atoi_x(argv[8]), atoi_x(argv[9]), atoi_x(argv[10]), atoi_x(argv[11]), atoi_x(argv[12]) };
+        return command_trigger_vibration_raw(ds, argv[1], strengths, atoi_x(argv[13]));
+    }
+
+    /* mostly to test raw parameters without any kind of bitpacking or range check */
+    uint8_t param1 = argc > 3 ? atoi_x(argv[3]) : 0;
+    uint8_t param2 = argc > 4 ? atoi_x(argv[4]) : 0;
+    uint8_t param3 = argc > 5 ? atoi_x(argv[5]) : 0;
+    uint8_t param4 = argc > 6 ? atoi_x(argv[6]) : 0;
+    uint8_t param5 = argc > 7 ? atoi_x(argv[7]) : 0;
+    uint8_t param6 = argc > 8 ? atoi_x(argv[8]) : 0;
+    uint8_t param7 = argc > 9 ? atoi_x(argv[9]) : 0;
+    uint8_t param8 = argc > 10 ? atoi_x(argv[10]) : 0;
+    uint8_t param9 = argc > 11 ? atoi_x(argv[11]) : 0;
+
+    return command_trigger(ds, argv[1], atoi_x(argv[2]), param1, param2, param3, param4, param5, param6, param7, param8, param9);
+}
+
+#define SEQUENCE_MAX_ARGS 16
+#define SEQUENCE_MAX_TIME (7 * 24 * 3600) /* s */
+
+/*
+ * Trigger timeline, one TIME TRIGGER MODE [PARAMS] line per event with TIME in
+ * seconds from the start. Events are parsed into the trigger sections they
+ * set when loading, so playback only copies those into the state and flushes.
+ */
+struct trigger_event {
+    uint64_t time; /* ns */
+    struct dualsense_output_report_common state; /* Valid flags mark the sections set */
+};
+
+struct trigger_sequence {
+    struct trigger_event *events;
+    size_t count;
+};
+
+static bool trigger_sequence_load(struct trigger_sequence *seq, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    /* Effects accumulate like consecutive trigger commands */
+    struct dualsense offline;
+    memset(&offline, 0, sizeof(offline));
+    offline.out = stdout;
+    memset(seq, 0, sizeof(*seq));
+
+    char *line = NULL;
+    size_t size = 0;
+    int lineno = 0;
+    bool ok = true;
+    while (ok && getline(&line, &size, f) >= 0) {
+        lineno++;
+        line[strcspn(line, "#")] = '\0';
+        char *argv[SEQUENCE_MAX_ARGS] = { "trigger" };
+        int argc = 1;
+        char *save;
+        char *time = strtok_r(line, " \t\r\n", &save);
+        if (!time) {
+            continue;
+        }
+        char *arg;
+        while ((arg = strtok_r(NULL, " \t\r\n", &save)) && argc < SEQUENCE_MAX_ARGS) {
+            argv[argc++] = arg;
+        }
+
+        char *end;
+        double t = strtod(time, &end);
+        /* Also rejects NaN, before converting to an integer */
+        if (*end || !(t >= 0 && t <= SEQUENCE_MAX_TIME) ||
+            (seq->count && (uint64_t)(t * 1e9) < seq->events[seq->count - 1].time)) {
+            fprintf(stderr, "%s:%d: invalid time '%s'\n", path, lineno, time);
+            ok = false;
+        } else if (arg) {
+            fprintf(stderr, "%s:%d: too many arguments\n", path, lineno);
+            ok = false;
+        } else if (parse_trigger(&offline, argc, argv)) {
+            fprintf(stderr, "%s:%d: invalid trigger effect\n", path, lineno);
+            ok = false;
+        } else {
+            struct trigger_event *tmp = realloc(seq->events, (seq->count + 1) * sizeof(*seq->events));
+            if (!tmp) {
+                perror("realloc");
+                ok = false;
+                break;
+            }
+            seq->events = tmp;
+            seq->events[seq->count].time = t * 1e9;
+            seq->events[seq->count].state = offline.state;
+            seq->count++;
+            offline.state.valid_flag0 = 0;
+        }
+    }
+    free(line);
+    fclose(f);
+
+    if (ok && !seq->count) {
+        fprintf(stderr, "%s: no events\n", path);
+        ok = false;
+    }
+    if (!ok) {
+        free(seq->events);
+    }
+    return ok;
+}
+
+/* Copies the sections marked valid in src into the pending state. */
+static void dualsense_merge_state(struct dualsense *ds, const struct dualsense_output_report_common *src)
+{
+    uint8_t *state = (uint8_t *)&ds->state;
+    const uint8_t *data = (const uint8_t *)src;
+    for (size_t i = 0; i < sizeof(dualsense_output_sections) / sizeof(*dualsense_output_sections); ++i) {
+        const struct dualsense_output_section *s = &dualsense_output_sections[i];
+        if (data[s->flag] & s->bit) {
+            memcpy(state + s->offset, data + s->offset, s->size);
+            state[s->flag] |= s->bit;
+        }
+    }
+}
+
+/* Plays a trigger timeline loops times, or until interrupted if loops is 0. */
+static int command_trigger_sequence(struct dualsense *ds, const struct trigger_sequence *seq, int loops)
+{
+    uint64_t period = seq->events[seq->count - 1].time;
+    if (loops != 1 && !period) {
+        fprintf(stderr, "Looping needs events after time 0\n");
+        return 2;
+    }
+
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        perror("timerfd_create");
+        return 2;
+    }
+    install_quit_handler();
+    prctl(PR_SET_TIMERSLACK, 1);
+
+    struct jitter_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    uint64_t start = monotonic_ns();
+    uint64_t reports = ds->reports_sent;
+    int ret = 0;
+    for (int loop = 0; (!loops || loop < loops) && !quit_requested && !ret; ++loop) {
+        /* Events at 0 of the next loop follow the last event of this one */
+        size_t i = 0;
+        while (i < seq->count && !quit_requested) {
+            uint64_t deadline = start + seq->events[i].time;
+            if (monotonic_ns() < deadline) {
+                timerfd_set_deadline(timer_fd, deadline);
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+                    continue;
+                }
+            }
+            uint64_t time = seq->events[i].time;
+            while (i < seq->count && seq->events[i].time == time) {
+                dualsense_merge_state(ds, &seq->events[i++].state);
+            }
+            if (!dualsense_flush(ds)) {
+                ret = 2;
+                break;
+            }
+            jitter_stats_add(&stats, deadline, monotonic_ns());
+        }
+        start += period;
+    }
+
+    close(timer_fd);
+    fprintf(stderr, "%" PRIu64 " output reports sent\n", ds->reports_sent - reports);
+    jitter_stats_print(&stats);
+    return ret;
+}
+
+static int parse_trigger_sequence(struct dualsense *ds, int argc, char *argv[])
+{
+    int loops = 1;
+    if (argc == 4 && !strcmp(argv[1], "-n")) {
+        loops = atoi_x(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 2 || loops < 0) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 2;
+    }
+
+    struct trigger_sequence seq;
+    if (!trigger_sequence_load(&seq, argv[1])) {
+        return 2;
+    }
+    int ret = command_trigger_sequence(ds, &seq, loops);
+    free(seq.events);
+    return ret;
+}
+
+/*
+ * Compiles NAME MODE [PARAMS] lines, with the mode and parameters of the
+ * trigger command, into a trigger effect library.
+ */
+static int command_effects_compile(const char *input, const char *output)
+{
+    FILE *in = fopen(input, "r");
+    if (!in) {
+        fprintf(stderr, "Failed to open %s: %s\n", input, strerror(errno));
+        return 1;
+    }
+
+    struct trigger_library_effect *effects = NULL;
+    uint32_t count = 0;
+    char *line = NULL;
+    size_t size = 0;
+    int lineno = 0;
+    int ret = 0;
+    while (!ret && getline(&line, &size, in) >= 0) {
+        lineno++;
+        line[strcspn(line, "#")] = '\0';
+        char *argv[SEQUENCE_MAX_ARGS] = { "trigger", "right" };
+        int argc = 2;
+        char *save;
+        char *name = strtok_r(line, " \t\r\n", &save);
+        if (!name) {
+            continue;
+        }
+        char *arg;
+        while ((arg = strtok_r(NULL, " \t\r\n", &save)) && argc < SEQUENCE_MAX_ARGS) {
+            argv[argc++] = arg;
+        }
+
+        if (strlen(name) >= TRIGGER_EFFECT_NAME_SIZE || name[strspn(name, "0123456789")] == '\0') {
+            fprintf(stderr, "%s:%d: invalid effect name '%s'\n", input, lineno, name);
+            ret = 1;
+            break;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!strcmp(effects[i].name, name)) {
+                fprintf(stderr, "%s:%d: duplicate effect '%s'\n", input, lineno, name);
+                ret = 1;
+            }
+        }
+        if (!ret && arg) {
+            fprintf(stderr, "%s:%d: too many arguments\n", input, lineno);
+            ret = 1;
+        }
+        struct dualsense offline;
+        memset(&offline, 0, sizeof(offline));
+        offline.out = stdout;
+        if (!ret && (argc < 3 || !strcmp(argv[2], "effect") || parse_trigger(&offline, argc, argv))) {
+            fprintf(stderr, "%s:%d: invalid trigger effect\n", input, lineno);
+            ret = 1;
+        }
+        if (ret) {
+            break;
+        }
+
+        struct trigger_library_effect *tmp = realloc(effects, (count + 1) * sizeof(*effects));
+        if (!tmp) {
+            perror("realloc");
+            ret = 1;
+            break;
+        }
+        effects = tmp;
+        memset(&effects[count], 0, sizeof(*effects));
+        memcpy(effects[count].name, name, strlen(name));
+        effects[count].effect[0] = offline.state.right_trigger_motor_mode;
+        memcpy(effects[count].effect + 1, offline.state.right_trigger_param, sizeof(offline.state.right_trigger_param));
+        count++;
+    }
+    free(line);
+    fclose(in);
+
+    if (!ret && !count) {
+        fprintf(stderr, "%s: no effects\n", input);
+        ret = 1;
+    }
+    if (ret) {
+        free(effects);
+        return ret;
+    }
+
+    /* At most half full keeps probe sequences short */
+    uint32_t table_size = 8;
+    while (table_size < count * 2) {
+        table_size *= 2;
+    }
+    uint32_t *table = calloc(table_size, sizeof(*table));
+    if (!table) {
+        perror("calloc");
+        free(effects);
+        return 1;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t slot = trigger_library_hash(effects[i].name) & (table_size - 1);
+        while (table[slot]) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+        table[slot] = i + 1;
+    }
+
+    struct trigger_library_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRIGGER_LIBRARY_MAGIC, sizeof(header.magic));
+    header.version = TRIGGER_LIBRARY_VERSION;
+    header.header_size = sizeof(header);
+    header.record_size = sizeof(*effects);
+    header.count = count;
+    header.table_size = table_size;
+
+    char tmp[PATH_MAX + 16];
+    FILE *out = compiled_file_create(output, tmp, sizeof(tmp));
+    bool written = out && fwrite(&header, sizeof(header), 1, out) == 1 &&
+                   fwrite(table, sizeof(*table), table_size, out) == table_size &&
+                   fwrite(effects, sizeof(*effects), count, out) == count;
+    if (!out || !compiled_file_commit(out, tmp, output, written)) {
+        fprintf(stderr, "Failed to write %s\n", output);
+        ret = 1;
+    }
+    free(table);
+    free(effects);
+    return ret;
+}
+
+static int command_effects_list(const char *path)
+{
+    struct trigger_library lib;
+    if (!trigger_library_open(&lib, path)) {
+        return 1;
+    }
+    for (uint32_t i = 0; i < lib.header->count; ++i) {
+        const struct trigger_library_effect *e = &lib.effects[i];
+        printf("%u %.*s", i, TRIGGER_EFFECT_NAME_SIZE, e->name);
+        for (int j = 0; j < TRIGGER_EFFECT_SIZE; ++j) {
+            printf(" %02x", e->effect[j]);
+        }
+        printf("\n");
+    }
+    trigger_library_close(&lib);
+    return 0;
+}
+
+static int dispatch_command(struct dualsense *ds, int argc, char *argv[])
+{
+    if (!strcmp(argv[0], "power-off")) {
+        return command_power_off(ds);
+    } else if (!strcmp(argv[0], "battery")) {
+        return command_battery(ds);
+    } else if (!strcmp(argv[0], "info")) {
+        return command_info(ds);
+    } else if (!strcmp(argv[0], "record")) {
+        if (argc != 2) {
+            fprintf(stderr, "Invalid arguments\n");
+            return 2;
+        }
+        return command_record(ds, argv[1]);
+    } else if (!strcmp(argv[0], "stream")) {
+        if (argc > 2) {
+            fprintf(stderr, "Invalid arguments\n");
+            return 2;
+        }
+        return command_stream(ds, argc == 2 ? argv[1] : NULL);
+    } else if (!strcmp(argv[0], "lightbar")) {
+        if (argc == 2) {
+            return command_lightbar1(ds, argv[1]);
+        } else if (argc == 4 || argc == 5) {
+            uint8_t brightness = argc == 5 ? atoi_x(argv[4]) : 255;
+            return command_lightbar3(ds, atoi_x(argv[1]), atoi_x(argv[2]), atoi_x(argv[3]), brightness);
+        } else {
+            fprintf(stderr, "Invalid arguments\n");
+            return 2;
+        }
+    } else if (!strcmp(argv[0], "animate")) {
+        return parse_animate(ds, argc, argv);
+    } else if (!strcmp(argv[0], "profile")) {
+        if ((argc != 3 && argc != 4) || strcmp(argv[1], "apply")) {
+            fprintf(stderr, "Invalid arguments\n");
+            return 2;
+        }
+        return command_profile_apply(ds, argv[2], argc == 4 ? argv[3] : NULL);
+    } else if (!strcmp(argv[0], "led-brightness")) {
+        if (argc != 2) {
+            fprintf(stderr, "Invalid arguments\n");
+            return 2;
+        }
+        return command_led_brightness(ds, atoi_x(argv[1]));
+    } else if (!strcmp(argv[0], "player-leds")) {
+        bool instant;
+        if (argc == 2) {
+            instant = false;
+        } else if (argc == 3) {
+            instant = !strcmp(argv[2], "instant");
+        } else {
+            fprintf(stderr, "Invalid arguments\n");
+            return 2;
+        }
+        return command_player_leds(ds, atoi_x(argv[1]), instant);
+    } else if (!strcmp(argv[0], "microphone")) {
+        if (argc != 2) {
+            fprintf(stderr, "Invalid arguments\n");
+            return 2;
+        }
+        return command_microphone(ds, argv[1]);
+    } else if (!strcmp(argv[0], "microphone-led")) {
+        if (argc != 2) {
+            fprintf(stderr, "Invalid arguments\n");
+            return 2;
+        }
+        return command_microphone_led(ds, argv[1]);
+    } else if (!strcmp(argv[0], "microphone-mode")) {
+        if (argc != 2) {
+            fprintf(stderr, "Invalid arguments\n");
+            return 2;
+        }
+        return command_microphone_mode(ds, argv[1]);
+    } else if (!strcmp(argv[0], "speaker")) {
+        if (argc != 2) {
+            fprintf(stderr, "Invalid arguments\n");
+            return 2;
+        }
+        return command_speaker(ds, argv[1]);
+    } else if (!strcmp(argv[0], "volume")) {
+        if (argc != 2 && argc != 3) {
+            fprintf(stderr, "Invalid arguments\n");
+            return 2;
+        }
+        if (atoi_x(argv[1]) > 255) {
+            fprintf(stderr, "Invalid volume\n");
+            return 1;
+        }
+        return command_volume(ds, atoi_x(argv[1]), argc == 3 ? argv[2] : NULL);
+    } else if (!strcmp(argv[0], "attenuation")) {
+        if (argc != 3) {
+            fprintf(stderr, "Invalid arguments\n");
+            return 2;
+        }
+        int rumble = strcmp(argv[1], "-") ? atoi_x(argv[1]) : -1;
+        int trigger = strcmp(argv[2], "-") ? atoi_x(argv[2]) : -1;
+        if ((rumble > 7) | (trigger > 7)) {
+            fprintf(stderr, "Invalid attenuation\n");
+            return 1;
+        }
+        return command_vibration_attenuation(ds, rumble, trigger);
+    } else if (!strcmp(argv[0], "trigger")) {
+        return parse_trigger(ds, argc, argv);
+    } else if (!strcmp(argv[0], "sequence")) {
+        return parse_trigger_sequence(ds, argc, argv);
+    } else {
+        fprintf(stderr, "Invalid command\n");
+        return 2;
+    }
+}
+
+/*
+ * Runs one or more commands separated by "+" and sends all their changes in
+ * a single output report. Nothing is sent if any of the commands fails.
+ */
+static int run_command(struct dualsense *ds, int argc, char *argv[])
+{
+    int start = 0;
+    for (int i = 0; i <= argc; ++i) {
+        if (i < argc && strcmp(argv[i], "+")) {
+            continue;
+        }
+        if (i == start) {
+            fprintf(stderr, "Invalid arguments\n");
+            dualsense_discard(ds);
+            return 2;
+        }
+        int ret = dispatch_command(ds, i - start, argv + start);
+        if (ret) {
+            dualsense_discard(ds);
+            return ret;
+        }
+        start = i + 1;
+    }
+    return dualsense_flush(ds) ? 0 : 2;
+}
+
+/* Profile keys and the command each one runs with the value as arguments. */
+static const struct {
+    const char *key;
+    const char *command[2];
+} profile_keys[] = {
+    { "lightbar", { "lightbar" } },
+    { "led-brightness", { "led-brightness" } },
+    { "player-leds", { "player-leds" } },
+    { "microphone", { "microphone" } },
+    { "microphone-led", { "microphone-led" } },
+    { "microphone-mode", { "microphone-mode" } },
+    { "speaker", { "speaker" } },
+    { "volume", { "volume" } },
+    { "attenuation", { "attenuation" } },
+    { "trigger-left", { "trigger", "left" } },
+    { "trigger-right", { "trigger", "right" } },
+};
+
+static char *profile_trim(char *s)
+{
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+/* Packs the state built from a profile section into complete USB and BT reports. */
+static void profile_pack(struct dualsense *ds, struct dualsense_profile *profile)
+{
+    struct dualsense_output_report rp;
+    uint8_t rbuf[DS_OUTPUT_REPORT_BT_SIZE];
+
+    ds->bt = false;
+    dualsense_init_output_report(ds, &rp, rbuf);
+    *rp.common = ds->state;
+    memcpy(profile->usb, rp.data, sizeof(profile->usb));
+
+    ds->bt = true;
+    ds->output_seq = 0;
+    dualsense_init_output_report(ds, &rp, rbuf);
+    *rp.common = ds->state;
+    memcpy(profile->bt, rp.data, sizeof(profile->bt));
+}
+
+/*
+ * Compiles an INI file with one [NAME] section per profile and KEY = VALUE
+ * lines from profile_keys into a profile file. Values are checked by the same
+ * commands that run for them on the command line.
+ */
+static int command_profile_compile(const char *input, const char *output)
+{
+    FILE *in = fopen(input, "r");
+    if (!in) {
+        fprintf(stderr, "Failed to open %s: %s\n", input, strerror(errno));
+        return 1;
+    }
+
+    struct dualsense_profile *profiles = NULL;
+    size_t count = 0;
+    struct dualsense ds;
+    char *line = NULL;
+    size_t size = 0;
+    int lineno = 0;
+    int ret = 0;
+    while (!ret && getline(&line, &size, in) >= 0) {
+        lineno++;
+        line[strcspn(line, "#;")] = '\0';
+        char *s = profile_trim(line);
+        if (!*s) {
+            continue;
+        }
+
+        if (*s == '[') {
+            char *end = strchr(s, ']');
+            if (!end || end[1] || end - s - 1 < 1 || end - s - 1 >= DS_PROFILE_NAME_SIZE) {
+                fprintf(stderr, "%s:%d: invalid section name\n", input, lineno);
+                ret = 1;
+                break;
+            }
+            if (count) {
+                profile_pack(&ds, &profiles[count - 1]);
+            }
+            struct dualsense_profile *tmp = realloc(profiles, (count + 1) * sizeof(*profiles));
+            if (!tmp) {
+                perror("realloc");
+                ret = 1;
+                break;
+            }
+            profiles = tmp;
+            memset(&profiles[count], 0, sizeof(*profiles));
+            memcpy(profiles[count].name, s + 1, end - s - 1);
+            count++;
+            memset(&ds, 0, sizeof(ds));
+            ds.out = stdout;
+            continue;
+        }
+
+        char *value = strchr(s, '=');
+        if (!count || !value) {
+            fprintf(stderr, "%s:%d: expected [NAME] or KEY = VALUE\n", input, lineno);
+            ret = 1;
+            break;
+        }
+        *value++ = '\0';
+        char *key = profile_trim(s);
+        size_t k = 0;
+        while (k < sizeof(profile_keys) / sizeof(*profile_keys) && strcmp(profile_keys[k].key, key)) {
+            k++;
+        }
+        if (k == sizeof(profile_keys) / sizeof(*profile_keys)) {
+            fprintf(stderr, "%s:%d: unknown key '%s'\n", input, lineno, key);
+            ret = 1;
+            break;
+        }
+
+        char *argv[PROFILE_MAX_ARGS];
+        int argc = 0;
+        for (int i = 0; i < 2 && profile_keys[k].command[i]; ++i) {
+            argv[argc++] = (char *)profile_keys[k].command[i];
+        }
+        char *save;
+        for (char *arg = strtok_r(value, " \t\r\n", &save); arg && argc < PROFILE_MAX_ARGS; arg = strtok_r(NULL, " \t\r\n", &save)) {
+            argv[argc++] = arg;
+        }
+        if (dispatch_command(&ds, argc, argv)) {
+            fprintf(stderr, "%s:%d: invalid value for '%s'\n", input, lineno, key);
+            ret = 1;
+        }
+    }
+    free(line);
+    fclose(in);
+
+    if (!ret && !count) {
+        fprintf(stderr, "%s: no profiles\n", input);
+        ret = 1;
+    }
+    if (!ret) {
+        profile_pack(&ds, &profiles[count - 1]);
+
+        struct dualsense_profile_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DS_PROFILE_MAGIC, sizeof(header.magic));
+        header.version = DS_PROFILE_VERSION;
+        header.header_size = sizeof(header);
+        header.record_size = sizeof(*profiles);
+
+        char tmp[PATH_MAX + 16];
+        FILE *out = compiled_file_create(output, tmp, sizeof(tmp));
+        bool written = out && fwrite(&header, sizeof(header), 1, out) == 1 &&
+                       fwrite(profiles, sizeof(*profiles), count, out) == count;
+        if (!out || !compiled_file_commit(out, tmp, output, written)) {
+            fprintf(stderr, "Failed to write %s\n", output);
+            ret = 1;
+        }
+    }
+    free(profiles);
+    return ret;
+}
+
+#define DAEMON_MAX_DEVICES 16
+#define DAEMON_MAX_ARGS 64
+#define DAEMON_MAX_REQUEST 4096
+#define DAEMON_MAX_EVENTS 32
+#define DAEMON_METRICS_SIZE 65536
+#define DAEMON_METRICS_CLIENTS 8
+#define DAEMON_METRICS_INTERVAL 15 /* Seconds between metrics file updates */
+
+static const char *metrics_file = NULL;
+static int metrics_port = 0;
+static const char *metrics_address = "127.0.0.1";
+
+#define MULTI_MAX_DEVICES 64
+
+/* Command running on one of several devices, see run_command_multi(). */
+struct dualsense_job {
+    struct dualsense ds;
+    pthread_t thread;
+    int argc;
+    char **argv;
+    int ret;
+    char *output;
+    size_t output_size;
+};
+
+static void *dualsense_job_run(void *data)
+{
+    struct dualsense_job *job = data;
+    job->ds.out = open_memstream(&job->output, &job->output_size);
+    if (!job->ds.out) {
+        job->ds.out = stdout;
+    }
+    job->ret = run_command(&job->ds, job->argc, job->argv);
+    if (job->ds.out != stdout) {
+        fclose(job->ds.out);
+    }
+    return NULL;
+}
+
+/*
+ * Runs a command on all devices or a comma separated list of serials, with
+ * one thread per device. Output lines are prefixed with the MAC address.
+ */
+static int run_command_multi(const char *serials, int argc, char *argv[])
+{
+    for (int i = 0; i < argc; ++i) {
+        /* Only command names, the first argument and those after + */
+        if (i && strcmp(argv[i - 1], "+")) {
+            continue;
+        }
+        if (!strcmp(argv[i], "stream") || !strcmp(argv[i], "record")) {
+            fprintf(stderr, "%s is not supported with several devices\n", argv[i]);
+            return 1;
+        }
+    }
+
+    const struct dualsense_transport *transport = dualsense_transport();
+    struct dualsense_device_info *devs = dualsense_enumerate(transport);
+    struct dualsense_device_info *targets[MULTI_MAX_DEVICES];
+    int count = 0;
+    int ret = 0;
+
+    if (!strcmp(serials, "all")) {
+        for (struct dualsense_device_info *dev = devs; dev && count < MULTI_MAX_DEVICES; dev = dev->next) {
+            targets[count++] = dev;
+        }
+        if (!count) {
+            fprintf(stderr, "No device found\n");
+            ret = 1;
+        }
+    } else {
+        const char *serial = serials;
+        while (*serial && count < MULTI_MAX_DEVICES) {
+            size_t len = strcspn(serial, ",");
+            struct dualsense_device_info *dev = devs;
+            while (dev && (strlen(dev->serial) != len || strncasecmp(serial, dev->serial, len))) {
+                dev = dev->next;
+            }
+            if (!dev) {
+                fprintf(stderr, "Device '%.*s' not found\n", (int)len, serial);
+                ret = 1;
+            } else {
+                targets[count++] = dev;
+            }
+            serial += len + (serial[len] == ',');
+        }
+    }
+
+    struct dualsense_job *jobs = calloc(count, sizeof(*jobs));
+    int opened = 0;
+    if (!ret && !jobs) {
+        fprintf(stderr, "Out of memory\n");
+        ret = 2;
+    }
+    for (; !ret && opened < count; ++opened) {
+        if (!dualsense_open(&jobs[opened].ds, transport, targets[opened])) {
+            ret = 1;
+            break;
+        }
+    }
+    dualsense_free_enumeration(devs);
+
+    int started = 0;
+    for (; !ret && started < count; ++started) {
+        jobs[started].argc = argc;
+        jobs[started].argv = argv;
+        if (pthread_create(&jobs[started].thread, NULL, dualsense_job_run, &jobs[started])) {
+            fprintf(stderr, "Failed to start thread\n");
+            ret = 2;
+            break;
+        }
+    }
+
+    for (int i = 0; i < started; ++i) {
+        struct dualsense_job *job = &jobs[i];
+        pthread_join(job->thread, NULL);
+
+        const char *line = job->output;
+        while (line && *line) {
+            size_t len = strcspn(line, "\n");
+            printf("%s: %.*s\n", job->ds.mac_address, (int)len, line);
+            line += len + (line[len] == '\n');
+        }
+        free(job->output);
+        if (job->ret > ret) {
+            ret = job->ret;
+        }
+    }
+
+    for (int i = 0; i < opened; ++i) {
+        dualsense_destroy(&jobs[i].ds);
     }
-    if (snap_force > 8 || !(snap_force > 0)) {
-        fprintf(stderr, "snap_force must be between 1 and 8\n");
-        return 1;
+    free(jobs);
+    return ret;
+}
+
+/* battery --all results of the last full read, reused by --max-age. */
+static int battery_cache_load(struct battery_entry *entries, double max_age)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    FILE *f = runtime_file_path("dualsensectl.battery", path, sizeof(path)) ? runtime_file_open(path, &st) : NULL;
+    if (!f) {
+        return -1;
     }
 
-    uint16_t start_stop_zones = (uint16_t)((1 << start_position) | (1 << end_position));
-    uint32_t force_pair =  (uint16_t)(((strength -1) & 0x07) | (((snap_force -1 ) & 0x07) << 3 ));
-    return command_trigger(ds, trigger, DS_TRIGGER_EFFECT_BOW,
-                           (uint8_t)((start_stop_zones >> 0) & 0xff),
-                           (uint8_t)((start_stop_zones >> 8) & 0xff),
-                           (uint8_t)((force_pair >> 0) & 0xff),
-                           0, 0, 0, 0, 0, 0);
+    if (difftime(time(NULL), st.st_mtime) > max_age) {
+        fclose(f);
+        return -1;
+    }
+
+    int count = 0;
+    char transport[4];
+    int capacity;
+    struct battery_entry *e = &entries[0];
+    while (count < MULTI_MAX_DEVICES &&
+           fscanf(f, "%17s %3s %d %15s", e->mac_address, transport, &capacity, e->status) == 4) {
+        e->bt = !strcmp(transport, "bt");
+        e->valid = capacity >= 0;
+        e->capacity = e->valid ? capacity : 0;
+        e = &entries[++count];
+    }
+    fclose(f);
+    return count;
 }
 
-static int command_trigger_galloping(struct dualsense *ds, char *trigger, uint8_t start_position, uint8_t end_position, uint8_t first_foot, uint8_t second_foot, uint8_t frequency)
+static void battery_cache_store(const struct battery_entry *entries, int count)
 {
-    if (start_position > 8) {
-        fprintf(stderr, "start position must be between 0 and 8\n");
-        return 1;
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 16];
+    FILE *f = runtime_file_path("dualsensectl.battery", path, sizeof(path)) ? runtime_file_create(path, tmp, sizeof(tmp)) : NULL;
+    if (!f) {
+        return;
     }
-    if (end_position > 9 || end_position < start_position+1) {
-        fprintf(stderr, "end position must be between start position+1 and 9\n");
-        return 1;
+    for (int i = 0; i < count; ++i) {
+        const struct battery_entry *e = &entries[i];
+        fprintf(f, "%s %s %d %s\n", e->mac_address, e->bt ? "bt" : "usb",
+                e->valid ? e->capacity : -1, e->valid ? e->status : "unavailable");
     }
-    if (first_foot > 6) {
-        fprintf(stderr, "first_foot must be between 0 and 8\n");
-        return 1;
+    runtime_file_commit(f, tmp, path);
+}
+
+struct battery_job {
+    struct dualsense ds;
+    pthread_t thread;
+    struct battery_entry *entry;
+};
+
+static void *battery_job_run(void *data)
+{
+    struct battery_job *job = data;
+    uint8_t report[DS_INPUT_REPORT_BT_SIZE];
+    uint64_t deadline = monotonic_ns() + 1000000000;
+
+    memcpy(job->entry->mac_address, job->ds.mac_address, sizeof(job->entry->mac_address));
+    job->entry->bt = job->ds.bt;
+    while (monotonic_ns() < deadline) {
+        int res = job->ds.transport->read_timeout(job->ds.dev, report, sizeof(report), 100);
+        if (res < 0) {
+            break;
+        }
+        struct dualsense_input_report *r = res ? dualsense_parse_input_report(&job->ds, report, res) : NULL;
+        if (r) {
+            battery_entry_set(job->entry, &job->ds, r);
+            break;
+        }
     }
-    if (second_foot > 7 || second_foot < first_foot+1) {
-        fprintf(stderr, "second_foot must be between first_foot+1 and 8\n");
-        return 1;
+    return NULL;
+}
+
+/*
+ * Reads the battery state of all controllers in parallel, or takes it from
+ * the cache when that is at most max_age seconds old.
+ */
+static int command_battery_all(bool json, double max_age)
+{
+    static struct battery_entry entries[MULTI_MAX_DEVICES + 1];
+    int count = max_age > 0 ? battery_cache_load(entries, max_age) : -1;
+    if (count >= 0) {
+        print_battery_entries(entries, count, json);
+        return 0;
     }
 
-    if (!(frequency > 0)) {
-        fprintf(stderr, "frequency must be greater than 0\n");
-        return 1;
+    const struct dualsense_transport *transport = dualsense_transport();
+    struct dualsense_device_info *devs = dualsense_enumerate(transport);
+    static struct battery_job jobs[MULTI_MAX_DEVICES];
+    count = 0;
+    int running = 0;
+    for (struct dualsense_device_info *dev = devs; dev && count < MULTI_MAX_DEVICES; dev = dev->next) {
+        /* Devices that fail to open or read stay listed as unavailable */
+        struct battery_entry *e = &entries[count++];
+        memset(e, 0, sizeof(*e));
+        for (size_t i = 0; i < sizeof(e->mac_address) - 1 && dev->serial[i]; ++i) {
+            e->mac_address[i] = toupper(dev->serial[i]);
+        }
+        e->bt = dev->bt;
+        if (dualsense_open(&jobs[running].ds, transport, dev)) {
+            jobs[running].entry = e;
+            if (pthread_create(&jobs[running].thread, NULL, battery_job_run, &jobs[running])) {
+                dualsense_destroy(&jobs[running].ds);
+                continue;
+            }
+            running++;
+        }
     }
-    if (frequency > 8) {
-        fprintf(stdout, "frequency has a better effect when lower than 8\n");
+    dualsense_free_enumeration(devs);
+
+    for (int i = 0; i < running; ++i) {
+        pthread_join(jobs[i].thread, NULL);
+        dualsense_destroy(&jobs[i].ds);
     }
-    uint16_t start_stop_zones = (uint16_t)((1 << start_position) | (1 << end_position));
-    uint32_t ratio =  (uint16_t)((second_foot & 0x07) | ((first_foot & 0x07) << 3 ));
-    return command_trigger(ds, trigger, DS_TRIGGER_EFFECT_GALLOPING,
-                           (uint8_t)((start_stop_zones >> 0) & 0xff),
-                           (uint8_t)((start_stop_zones >> 8) & 0xff),
-                           (uint8_t)((ratio >> 0) & 0xff),
-                           frequency,
-                           0, 0, 0, 0, 0);
+    int ret = 0;
+    for (int i = 0; i < count; ++i) {
+        if (!entries[i].valid) {
+            ret = 2;
+        }
+    }
+
+    battery_cache_store(entries, count);
+    print_battery_entries(entries, count, json);
+    return ret;
 }
 
-static int command_trigger_machine(struct dualsense *ds, char *trigger, uint8_t start_position, uint8_t end_position, uint8_t strength_a, uint8_t strength_b, uint8_t frequency, uint8_t period)
+/* Parses battery --all [--json] [--max-age SECONDS], false if argv is something else. */
+static bool parse_battery_all(int argc, char *argv[], bool *json, double *max_age)
 {
-    // if start_position == 0 nothing happen
-    if (start_position > 8 || !(start_position > 0)) {
-        fprintf(stderr, "start position must be between 1 and 8\n");
-        return 1;
+    bool all = false;
+    *json = false;
+    *max_age = 0;
+    if (argc < 2 || strcmp(argv[0], "battery")) {
+        return false;
     }
-    if (end_position > 9 || end_position < start_position+1) {
-        fprintf(stderr, "end position must be between start position+1 and 9\n");
-        return 1;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--all")) {
+            all = true;
+        } else if (!strcmp(argv[i], "--json")) {
+            *json = true;
+        } else if (!strcmp(argv[i], "--max-age") && i + 1 < argc) {
+            *max_age = strtod(argv[++i], NULL);
+        } else {
+            return false;
+        }
     }
-    if (strength_a > 7) {
-        fprintf(stderr, "strength_a position must be between 0 and 7\n");
-        return 1;
+    return all;
+}
+
+/*
+ * Like the caches the socket only goes to the private $XDG_RUNTIME_DIR, clients
+ * pass their stdout and stderr through it. Returns false if neither that nor
+ * DUALSENSECTL_SOCKET is set.
+ */
+static bool daemon_socket_address(struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    const char *env = getenv("DUALSENSECTL_SOCKET");
+    if (env) {
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", env);
+    } else if (!runtime_file_path("dualsensectl.sock", addr->sun_path, sizeof(addr->sun_path))) {
+        fprintf(stderr, "XDG_RUNTIME_DIR is not set, set it or DUALSENSECTL_SOCKET\n");
+        return false;
     }
-    if (strength_b > 7) {
-        fprintf(stderr, "strength_b position must be between 0 and 7\n");
-        return 1;
+    return true;
+}
+
+/* Whether the other end of a daemon connection runs as the same user. */
+static bool daemon_peer_trusted(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return !getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) && cred.uid == getuid();
+}
+
+static int daemon_connect(const struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
     }
-    if (!(frequency > 0)) {
-        fprintf(stderr, "frequency must be greater than 0\n");
-        return 1;
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        close(fd);
+        return -1;
     }
-    uint16_t start_stop_zones = (uint16_t)((1 << start_position) | (1 << end_position));
-    uint32_t force_pair =  (uint16_t)((strength_a & 0x07) | ((strength_b & 0x07) << 3 ));
-    return command_trigger(ds, trigger, DS_TRIGGER_EFFECT_MACHINE,
-                           (uint8_t)((start_stop_zones >> 0) & 0xff),
-                           (uint8_t)((start_stop_zones >> 8) & 0xff),
-                           (uint8_t)((force_pair >> 0) & 0xff),
-                           frequency,
-                           period,
-                           0, 0, 0, 0);
+    if (!daemon_peer_trusted(fd)) {
+        close(fd);
+        errno = EPERM;
+        return -1;
+    }
+    return fd;
 }
 
-static int command_trigger_vibration(struct dualsense *ds, char *trigger, uint8_t position, uint8_t amplitude, uint8_t frequency)
+/* Device kept open by the daemon, with the latest input report it sent. */
+struct daemon_device {
+    struct dualsense ds;
+    bool active;
+    bool has_input;
+    struct dualsense_input_report input;
+    uint64_t input_time;
+    uint64_t reports;
+    uint64_t seq_gaps;
+    uint32_t firmware_version;
+    uint32_t hardware_info;
+};
+
+/* HTTP metrics connection waiting for its request. */
+struct daemon_metrics_client {
+    int fd;
+    uint64_t accepted;
+};
+
+/*
+ * epoll data of the event sources, metrics clients and devices use
+ * DAEMON_EVENT_METRICS_CLIENT or DAEMON_EVENT_DEVICE plus their slot so
+ * pointers stay valid while they come and go.
+ */
+enum {
+    DAEMON_EVENT_LISTEN,
+    DAEMON_EVENT_UDEV,
+    DAEMON_EVENT_METRICS,
+    DAEMON_EVENT_METRICS_TIMER,
+    DAEMON_EVENT_METRICS_CLIENT,
+    DAEMON_EVENT_DEVICE = DAEMON_EVENT_METRICS_CLIENT + DAEMON_METRICS_CLIENTS,
+};
+
+struct daemon {
+    int epoll_fd;
+    struct udev_monitor *monitor;
+    int metrics_fd;
+    struct daemon_metrics_client metrics_clients[DAEMON_METRICS_CLIENTS];
+    struct daemon_device devices[DAEMON_MAX_DEVICES];
+};
+
+static void daemon_watch(struct daemon *d, int fd, uint64_t data)
 {
-    if (position > 9) {
-        fprintf(stderr, "position must be between 0 and 9\n");
-        return 1;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = data;
+    if (epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
     }
-    if (amplitude > 8 || !(amplitude > 0)) {
-        fprintf(stderr, "amplitude must be between 1 and 8\n");
-        return 1;
+}
+
+static struct daemon_device *daemon_add_device(struct daemon *d, struct daemon_device *dev)
+{
+    dev->active = true;
+    dev->has_input = false;
+    dev->reports = 0;
+    dev->seq_gaps = 0;
+
+    struct dualsense_feature_report_firmware firmware;
+    memset(&firmware, 0, sizeof(firmware));
+    firmware.report_id = DS_FEATURE_REPORT_FIRMWARE_INFO;
+    if (dev->ds.transport->get_feature_report(dev->ds.dev, (uint8_t *)&firmware, sizeof(firmware)) == sizeof(firmware)) {
+        dev->firmware_version = firmware.firmware_version;
+        dev->hardware_info = firmware.hardware_info;
     }
-    if (!(frequency > 0)) {
-        fprintf(stderr, "frequency must be greater than 0\n");
-        return 1;
+    int fd = dev->ds.transport->fd ? dev->ds.transport->fd(dev->ds.dev) : -1;
+    if (fd >= 0) {
+        daemon_watch(d, fd, DAEMON_EVENT_DEVICE + (dev - d->devices));
     }
+    return dev;
+}
 
-    uint8_t strength_array[10] = {0};
-    for (int i = position; i < 10; i++) {
-        strength_array[i] = amplitude;
+static void daemon_remove_device(struct daemon *d, struct daemon_device *dev)
+{
+    int fd = dev->ds.transport->fd ? dev->ds.transport->fd(dev->ds.dev) : -1;
+    if (fd >= 0) {
+        epoll_ctl(d->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
     }
-    return trigger_bitpacking_array(ds, trigger, DS_TRIGGER_EFFECT_VIBRATION, strength_array, frequency);
+    dualsense_destroy(&dev->ds);
+    dev->active = false;
+}
 
+static struct daemon_device *daemon_free_slot(struct daemon *d)
+{
+    for (int i = 0; i < DAEMON_MAX_DEVICES; ++i) {
+        if (!d->devices[i].active) {
+            return &d->devices[i];
+        }
+    }
+    fprintf(stderr, "Too many devices\n");
+    return NULL;
 }
 
-static int command_trigger_feedback_raw(struct dualsense *ds, char *trigger, uint8_t strength[10] )
+static struct daemon_device *daemon_find_device(struct daemon *d, const char *serial)
 {
-    return trigger_bitpacking_array(ds, trigger, DS_TRIGGER_EFFECT_FEEDBACK, strength, 0);
+    for (int i = 0; i < DAEMON_MAX_DEVICES; ++i) {
+        if (d->devices[i].active && (!serial || !strcasecmp(serial, d->devices[i].ds.mac_address))) {
+            return &d->devices[i];
+        }
+    }
+    return NULL;
 }
 
-static int command_trigger_vibration_raw(struct dualsense *ds, char *trigger, uint8_t strength[10], uint8_t frequency)
+static struct daemon_device *daemon_get_device(struct daemon *d, const char *serial)
 {
-    return trigger_bitpacking_array(ds, trigger, DS_TRIGGER_EFFECT_VIBRATION, strength, frequency);
+    struct daemon_device *dev = daemon_find_device(d, serial);
+    if (dev) {
+        return dev;
+    }
+    dev = daemon_free_slot(d);
+    if (!dev || !dualsense_init(&dev->ds, serial)) {
+        return NULL;
+    }
+    return daemon_add_device(d, dev);
 }
 
-static bool sh_command_wait = false;
-static const char *sh_command_add = NULL;
-static const char *sh_command_remove = NULL;
+static void daemon_open_device(struct daemon *d, const struct dualsense_device_info *info)
+{
+    if (daemon_find_device(d, info->serial)) {
+        return;
+    }
+    struct daemon_device *dev = daemon_free_slot(d);
+    if (dev && dualsense_open(&dev->ds, dualsense_transport(), info)) {
+        daemon_add_device(d, dev);
+    }
+}
 
-static void run_sh_command(const char *command, const char *serial_number)
+/* Drains pending input reports, keeping the latest main input report. */
+static void daemon_read_input(struct daemon *d, struct daemon_device *dev)
 {
-    pid_t pid = fork();
-    if (pid == 0) {
-        if (!sh_command_wait) {
-            pid = fork();
+    uint8_t data[DS_INPUT_REPORT_BT_SIZE];
+    for (int i = 0; i < 16; ++i) {
+        int res = dev->ds.transport->read_timeout(dev->ds.dev, data, sizeof(data), 0);
+        if (res < 0) {
+            fprintf(stderr, "%s: %s\n", dev->ds.mac_address, dev->ds.transport->error(dev->ds.dev));
+            daemon_remove_device(d, dev);
+            return;
+        } else if (!res) {
+            return;
         }
-        if (pid == 0) {
-            setenv("DS_DEV", serial_number, 1);
-            if (system(command) < 0) {
-                perror("system");
+        struct dualsense_input_report *report = dualsense_parse_input_report(&dev->ds, data, res);
+        if (report) {
+            if (dev->has_input) {
+                dev->seq_gaps += (uint8_t)(report->seq_number - dev->input.seq_number - 1);
+            }
+            dev->input = *report;
+            dev->has_input = true;
+            dev->input_time = monotonic_ns();
+            dev->reports++;
+        }
+    }
+}
+
+/* battery --all from the input reports the daemon keeps anyway. */
+static int daemon_battery_all(struct daemon *d, bool json)
+{
+    struct battery_entry entries[DAEMON_MAX_DEVICES];
+    int count = 0;
+    for (int i = 0; i < DAEMON_MAX_DEVICES; ++i) {
+        struct daemon_device *dev = &d->devices[i];
+        if (!dev->active) {
+            continue;
+        }
+        struct battery_entry *e = &entries[count++];
+        memset(e, 0, sizeof(*e));
+        memcpy(e->mac_address, dev->ds.mac_address, sizeof(e->mac_address));
+        e->bt = dev->ds.bt;
+        if (!dev->has_input) {
+            daemon_read_input(d, dev);
+        }
+        if (dev->active && dev->has_input) {
+            battery_entry_set(e, &dev->ds, &dev->input);
+        }
+    }
+    print_battery_entries(entries, count, json);
+    return 0;
+}
+
+/* Appends to a fixed buffer, output is truncated once it is full. */
+struct metrics_buffer {
+    char *data;
+    size_t size;
+    size_t len;
+};
+
+__attribute__((format(printf, 2, 3)))
+static void metrics_printf(struct metrics_buffer *b, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(b->data + b->len, b->size - b->len, fmt, args);
+    va_end(args);
+    if (n > 0) {
+        b->len += (size_t)n < b->size - b->len ? (size_t)n : b->size - b->len - 1;
+    }
+}
+
+#define METRICS_FOREACH_DEVICE(d, dev) \
+    for (struct daemon_device *dev = (d)->devices; dev < (d)->devices + DAEMON_MAX_DEVICES; ++dev) \
+        if (dev->active)
+
+/* Renders all metrics in Prometheus text format into a static buffer. */
+static size_t daemon_render_metrics(struct daemon *d, const char **out)
+{
+    static char data[DAEMON_METRICS_SIZE];
+    struct metrics_buffer b = { data, sizeof(data), 0 };
+
+    metrics_printf(&b, "# TYPE dualsense_battery_capacity_percent gauge\n");
+    METRICS_FOREACH_DEVICE(d, dev) {
+        if (dev->has_input) {
+            uint8_t capacity;
+            const char *status;
+            dualsense_battery_status(&dev->input, &capacity, &status);
+            metrics_printf(&b, "dualsense_battery_capacity_percent{mac=\"%s\"} %u\n", dev->ds.mac_address, capacity);
+        }
+    }
+    metrics_printf(&b, "# TYPE dualsense_battery_status gauge\n");
+    METRICS_FOREACH_DEVICE(d, dev) {
+        if (dev->has_input) {
+            uint8_t capacity;
+            const char *status;
+            dualsense_battery_status(&dev->input, &capacity, &status);
+            metrics_printf(&b, "dualsense_battery_status{mac=\"%s\",status=\"%s\"} 1\n", dev->ds.mac_address, status);
+        }
+    }
+    metrics_printf(&b, "# TYPE dualsense_info gauge\n");
+    METRICS_FOREACH_DEVICE(d, dev) {
+        metrics_printf(&b, "dualsense_info{mac=\"%s\",transport=\"%s\",firmware=\"%x\",hardware=\"%x\"} 1\n",
+                       dev->ds.mac_address, dev->ds.bt ? "bt" : "usb", dev->firmware_version, dev->hardware_info);
+    }
+    metrics_printf(&b, "# TYPE dualsense_input_reports_total counter\n");
+    METRICS_FOREACH_DEVICE(d, dev) {
+        metrics_printf(&b, "dualsense_input_reports_total{mac=\"%s\"} %" PRIu64 "\n", dev->ds.mac_address, dev->reports);
+    }
+    metrics_printf(&b, "# TYPE dualsense_input_seq_gaps_total counter\n");
+    METRICS_FOREACH_DEVICE(d, dev) {
+        metrics_printf(&b, "dualsense_input_seq_gaps_total{mac=\"%s\"} %" PRIu64 "\n", dev->ds.mac_address, dev->seq_gaps);
+    }
+    metrics_printf(&b, "# TYPE dualsense_input_crc_errors_total counter\n");
+    METRICS_FOREACH_DEVICE(d, dev) {
+        metrics_printf(&b, "dualsense_input_crc_errors_total{mac=\"%s\"} %" PRIu64 "\n", dev->ds.mac_address, dev->ds.input_crc_errors);
+    }
+    metrics_printf(&b, "# TYPE dualsense_output_reports_total counter\n");
+    METRICS_FOREACH_DEVICE(d, dev) {
+        metrics_printf(&b, "dualsense_output_reports_total{mac=\"%s\"} %" PRIu64 "\n", dev->ds.mac_address, dev->ds.reports_sent);
+    }
+    metrics_printf(&b, "# TYPE dualsense_output_write_errors_total counter\n");
+    METRICS_FOREACH_DEVICE(d, dev) {
+        metrics_printf(&b, "dualsense_output_write_errors_total{mac=\"%s\"} %" PRIu64 "\n", dev->ds.mac_address, dev->ds.write_errors);
+    }
+    metrics_printf(&b, "# TYPE dualsense_output_write_seconds histogram\n");
+    METRICS_FOREACH_DEVICE(d, dev) {
+        uint64_t count = 0;
+        for (int i = 0; i <= DS_WRITE_BUCKETS; ++i) {
+            count += dev->ds.write_latency[i];
+            if (i < DS_WRITE_BUCKETS) {
+                metrics_printf(&b, "dualsense_output_write_seconds_bucket{mac=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+                               dev->ds.mac_address, dualsense_write_buckets[i] / 1e9, count);
+            } else {
+                metrics_printf(&b, "dualsense_output_write_seconds_bucket{mac=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+                               dev->ds.mac_address, count);
+            }
+        }
+        metrics_printf(&b, "dualsense_output_write_seconds_sum{mac=\"%s\"} %.9f\n", dev->ds.mac_address, dev->ds.write_latency_sum / 1e9);
+        metrics_printf(&b, "dualsense_output_write_seconds_count{mac=\"%s\"} %" PRIu64 "\n", dev->ds.mac_address, count);
+    }
+
+    *out = data;
+    return b.len;
+}
+
+/* Textfile collector style, replaced atomically. */
+static void daemon_write_metrics_file(struct daemon *d)
+{
+    static char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_file);
+
+    const char *data;
+    size_t len = daemon_render_metrics(d, &data);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    bool ok = write(fd, data, len) == (ssize_t)len;
+    if (close(fd) || !ok || rename(tmp, metrics_file)) {
+        fprintf(stderr, "Failed to write %s\n", metrics_file);
+        unlink(tmp);
+    }
+}
+
+/* Answers any HTTP request on the metrics port with the metrics. */
+static void daemon_serve_metrics(struct daemon *d, int fd)
+{
+    static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+    const char *data;
+    size_t len = daemon_render_metrics(d, &data);
+    struct iovec iov[2] = { { (void *)header, sizeof(header) - 1 }, { (void *)data, len } };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+        perror("sendmsg");
+    }
+}
+
+static void daemon_metrics_close(struct daemon *d, int slot)
+{
+    close(d->metrics_clients[slot].fd);
+    d->metrics_clients[slot].fd = -1;
+}
+
+/*
+ * Metrics connections are non-blocking and wait for their request in the
+ * epoll loop, so slow clients never stall devices and daemon clients. When
+ * all slots are taken the one waiting longest is dropped.
+ */
+static void daemon_metrics_accept(struct daemon *d)
+{
+    int fd = accept4(d->metrics_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    int slot = 0;
+    for (int i = 0; i < DAEMON_METRICS_CLIENTS; ++i) {
+        if (d->metrics_clients[i].fd < 0) {
+            slot = i;
+            break;
+        } else if (d->metrics_clients[i].accepted < d->metrics_clients[slot].accepted) {
+            slot = i;
+        }
+    }
+    if (d->metrics_clients[slot].fd >= 0) {
+        daemon_metrics_close(d, slot);
+    }
+    /* Room for the whole response, it is sent without waiting */
+    int size = 2 * DAEMON_METRICS_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    d->metrics_clients[slot].fd = fd;
+    d->metrics_clients[slot].accepted = monotonic_ns();
+    daemon_watch(d, fd, DAEMON_EVENT_METRICS_CLIENT + slot);
+}
+
+/* Any request gets the metrics, reading it only tells that it arrived. */
+static void daemon_metrics_read(struct daemon *d, int slot)
+{
+    char request[1024];
+    ssize_t res = recv(d->metrics_clients[slot].fd, request, sizeof(request), 0);
+    if (res < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (res > 0) {
+        daemon_serve_metrics(d, d->metrics_clients[slot].fd);
+    }
+    daemon_metrics_close(d, slot);
+}
+
+/* Listens on an IPv4 or IPv6 address, the metrics expose serials so only loopback by default. */
+static int daemon_metrics_listen(const char *address, int port)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    memset(&addr, 0, sizeof(addr));
+    struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+    if (inet_pton(AF_INET, address, &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        addr_len = sizeof(*in);
+    } else if (inet_pton(AF_INET6, address, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        addr_len = sizeof(*in6);
+    } else {
+        fprintf(stderr, "Invalid metrics address %s\n", address);
+        return -1;
+    }
+
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(fd, (struct sockaddr *)&addr, addr_len) < 0 || listen(fd, 16) < 0) {
+        fprintf(stderr, "Failed to listen on %s port %d: %s\n", address, port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void daemon_handle_udev(struct daemon *d)
+{
+    struct udev_device *udev_dev = udev_monitor_receive_device(d->monitor);
+    if (!udev_dev) {
+        return;
+    }
+
+    const char *action = udev_device_get_action(udev_dev);
+    const char *devnode = udev_device_get_devnode(udev_dev);
+    struct dualsense_device_info info;
+    if (!strcmp(action, "add") && hidraw_device_info(udev_dev, &info)) {
+        daemon_open_device(d, &info);
+    } else if (!strcmp(action, "remove") && devnode) {
+        for (int i = 0; i < DAEMON_MAX_DEVICES; ++i) {
+            if (d->devices[i].active && !strcmp(d->devices[i].ds.path, devnode)) {
+                daemon_remove_device(d, &d->devices[i]);
             }
-            exit(1);
-        } else if (pid < 0) {
-            perror("fork");
-            exit(1);
         }
-        exit(0);
-    } else if (pid < 0) {
-        perror("fork");
-    } else {
-        int status = 0;
-        waitpid(pid, &status, 0);
     }
+    udev_device_unref(udev_dev);
 }
 
-static uint32_t read_file_hex(const char *path)
+/*
+ * Commands that run until interrupted or for a long time would stall the
+ * event loop and outlive their client, they need their own process.
+ */
+static const char *daemon_blocking_command(int argc, char *argv[])
 {
-    uint32_t out = 0;
-    FILE *f = fopen(path, "r");
-    if (!f) {
-        return out;
-    }
-    if (fscanf(f, "%x", &out) != 1) {
-        fprintf(stderr, "Failed to read %s\n", path);
+    static const char *blocking[] = { "stream", "record", "animate", "sequence" };
+    for (int i = 0; i < argc; ++i) {
+        if (i && strcmp(argv[i - 1], "+")) {
+            continue;
+        }
+        for (size_t j = 0; j < sizeof(blocking) / sizeof(*blocking); ++j) {
+            if (!strcmp(argv[i], blocking[j])) {
+                return blocking[j];
+            }
+        }
     }
-    fclose(f);
-    return out;
+    return NULL;
 }
 
-static void read_file_str(const char *path, char *buf, size_t size)
+/*
+ * Request is a single datagram with NUL separated device serial (empty for
+ * any device) and command arguments, along with the client stdout and stderr
+ * file descriptors so command output goes straight to the client.
+ * Reply is the command exit code.
+ */
+static void daemon_handle_client(struct daemon *d, int fd)
 {
-    FILE *f = fopen(path, "r");
-    if (!f) {
+    char buf[DAEMON_MAX_REQUEST];
+    int fds[2] = { -1, -1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cmsg;
+    struct iovec iov = { buf, sizeof(buf) - 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+
+    ssize_t len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (len <= 0) {
         return;
     }
-    if (fread(buf, size, 1, f) != 1) {
-        fprintf(stderr, "Failed to read %s\n", path);
-    }
-    buf[size - 1] = '\0';
-    fclose(f);
-}
+    buf[len] = '\0';
 
-static bool check_dualsense_device(struct udev_device *dev, char serial_number[18])
-{
-    const char *path = udev_device_get_syspath(dev);
-    char *end = strrchr(path, '/');
-    if (!end || strncmp(end, "/event", 6)) {
-        return false;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(c), sizeof(fds));
     }
 
-    const char *joystick = udev_device_get_property_value(dev, "ID_INPUT_JOYSTICK");
-    if (!joystick || strcmp(joystick, "1")) {
-        return false;
+    const char *serial = buf;
+    char *argv[DAEMON_MAX_ARGS];
+    int argc = 0;
+    char *p = buf + strlen(buf) + 1;
+    while (p < buf + len && argc < DAEMON_MAX_ARGS) {
+        argv[argc++] = p;
+        p += strlen(p) + 1;
     }
 
-    size_t baselen = end - path + 1;
-    char idpath[256];
-    strncpy(idpath, path, baselen);
-    idpath[baselen] = '\0';
-    char *baseend = idpath + baselen;
-
-    strcpy(baseend, "id/vendor");
-    uint32_t vendor = read_file_hex(idpath);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int saved_stderr = dup(STDERR_FILENO);
+    if (fds[0] >= 0) {
+        dup2(fds[0], STDOUT_FILENO);
+    }
+    if (fds[1] >= 0) {
+        dup2(fds[1], STDERR_FILENO);
+    }
 
-    strcpy(baseend, "id/product");
-    uint32_t product = read_file_hex(idpath);
+    int32_t ret = 1;
+    bool json;
+    double max_age;
+    if (!argc) {
+        fprintf(stderr, "Invalid arguments\n");
+        ret = 2;
+    } else if (parse_battery_all(argc, argv, &json, &max_age)) {
+        ret = daemon_battery_all(d, json);
+    } else if (daemon_blocking_command(argc, argv)) {
+        fprintf(stderr, "%s is not supported through the daemon, run it without -c\n", daemon_blocking_command(argc, argv));
+        ret = 2;
+    } else {
+        struct daemon_device *dev = daemon_get_device(d, *serial ? serial : NULL);
+        if (dev) {
+            ret = run_command(&dev->ds, argc, argv);
+            /* Device may have gone away, reopen it on next command */
+            if (dev->ds.failed) {
+                daemon_remove_device(d, dev);
+            }
+        }
+    }
 
-    strcpy(baseend, "uniq");
-    read_file_str(idpath, serial_number, 18);
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stdout);
+    close(saved_stderr);
+    for (int i = 0; i < 2; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
 
-    return vendor == DS_VENDOR_ID && (product == DS_PRODUCT_ID || product == DS_EDGE_PRODUCT_ID);
+    send(fd, &ret, sizeof(ret), MSG_NOSIGNAL);
 }
 
-static void add_device(struct udev_device *dev)
+/*
+ * Serves clients, hotplug events and input reports of all devices from one
+ * epoll loop.
+ */
+static int command_daemon(void)
 {
-    char serial_number[18] = "00:00:00:00:00:00";
-    if (!check_dualsense_device(dev, serial_number)) {
-        return;
+    struct sockaddr_un addr;
+    if (!daemon_socket_address(&addr)) {
+        return 1;
     }
-    if (sh_command_add) {
-        run_sh_command(sh_command_add, serial_number);
+
+    int fd = daemon_connect(&addr);
+    if (fd >= 0) {
+        fprintf(stderr, "Daemon already running on %s\n", addr.sun_path);
+        close(fd);
+        return 1;
     }
-}
 
-static void remove_device(struct udev_device *dev)
-{
-    char serial_number[18] = "00:00:00:00:00:00";
-    if (!check_dualsense_device(dev, serial_number)) {
-        return;
+    /* Only replace a stale socket of our own */
+    struct stat st;
+    if (!lstat(addr.sun_path, &st)) {
+        if (!S_ISSOCK(st.st_mode) || st.st_uid != geteuid()) {
+            fprintf(stderr, "Refusing to replace %s, not a socket owned by this user\n", addr.sun_path);
+            return 1;
+        }
+        unlink(addr.sun_path);
     }
-    if (sh_command_remove) {
-        run_sh_command(sh_command_remove, serial_number);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", addr.sun_path, strerror(errno));
+        close(fd);
+        return 1;
     }
-}
 
-static int command_monitor(void)
-{
+    /* Input is watched through device fds, which hidapi does not expose */
+    if (!getenv("DUALSENSECTL_BACKEND")) {
+        setenv("DUALSENSECTL_BACKEND", "hidraw", 1);
+    }
+
+    static struct daemon d;
+    d.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (d.epoll_fd < 0) {
+        perror("epoll_create1");
+        close(fd);
+        return 1;
+    }
+    daemon_watch(&d, fd, DAEMON_EVENT_LISTEN);
+
     struct udev *u = udev_new();
-    struct udev_enumerate *enumerate = udev_enumerate_new(u);
-    udev_enumerate_add_match_subsystem(enumerate, "input");
-    udev_enumerate_scan_devices(enumerate);
-    struct udev_list_entry *devices = udev_enumerate_get_list_entry(enumerate);
-    struct udev_list_entry *dev_list_entry;
-    udev_list_entry_foreach(dev_list_entry, devices) {
-        const char *path = udev_list_entry_get_name(dev_list_entry);
-        struct udev_device *dev = udev_device_new_from_syspath(u, path);
-        add_device(dev);
-        udev_device_unref(dev);
+    d.monitor = u ? udev_monitor_new_from_netlink(u, "udev") : NULL;
+    if (d.monitor) {
+        udev_monitor_filter_add_match_subsystem_devtype(d.monitor, "hidraw", NULL);
+        udev_monitor_enable_receiving(d.monitor);
+        daemon_watch(&d, udev_monitor_get_fd(d.monitor), DAEMON_EVENT_UDEV);
     }
-    udev_enumerate_unref(enumerate);
 
-    struct udev_monitor *monitor = udev_monitor_new_from_netlink(u, "udev");
-    udev_monitor_filter_add_match_subsystem_devtype(monitor, "input", NULL);
-    udev_monitor_enable_receiving(monitor);
+    struct dualsense_device_info *devs = dualsense_enumerate(dualsense_transport());
+    for (struct dualsense_device_info *dev = devs; dev; dev = dev->next) {
+        daemon_open_device(&d, dev);
+    }
+    dualsense_free_enumeration(devs);
 
-    struct pollfd fd;
-    fd.fd = udev_monitor_get_fd(monitor);
-    fd.events = POLLIN;
+    d.metrics_fd = metrics_port ? daemon_metrics_listen(metrics_address, metrics_port) : -1;
+    for (int i = 0; i < DAEMON_METRICS_CLIENTS; ++i) {
+        d.metrics_clients[i].fd = -1;
+    }
+    if (d.metrics_fd >= 0) {
+        daemon_watch(&d, d.metrics_fd, DAEMON_EVENT_METRICS);
+    }
+    int metrics_timer = -1;
+    if (metrics_file) {
+        metrics_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_interval.tv_sec = DAEMON_METRICS_INTERVAL;
+        its.it_value.tv_nsec = 1;
+        timerfd_settime(metrics_timer, 0, &its, NULL);
+        daemon_watch(&d, metrics_timer, DAEMON_EVENT_METRICS_TIMER);
+    }
 
-    while (1) {
-        int ret = poll(&fd, 1, -1);
-        if (ret < 0) {
-            perror("poll");
+    install_quit_handler();
+    int ret = 0;
+    while (!quit_requested) {
+        struct epoll_event events[DAEMON_MAX_EVENTS];
+        int n = epoll_wait(d.epoll_fd, events, DAEMON_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            ret = 1;
             break;
         }
-        struct udev_device *dev = udev_monitor_receive_device(monitor);
-        if (!dev) {
-            continue;
+        for (int i = 0; i < n; ++i) {
+            uint64_t data = events[i].data.u64;
+            if (data == DAEMON_EVENT_LISTEN) {
+                int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+                if (client < 0) {
+                    continue;
+                }
+                if (!daemon_peer_trusted(client)) {
+                    close(client);
+                    continue;
+                }
+                struct timeval timeout = { 1, 0 };
+                setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                daemon_handle_client(&d, client);
+                close(client);
+            } else if (data == DAEMON_EVENT_UDEV) {
+                daemon_handle_udev(&d);
+            } else if (data == DAEMON_EVENT_METRICS) {
+                daemon_metrics_accept(&d);
+            } else if (data >= DAEMON_EVENT_METRICS_CLIENT && data < DAEMON_EVENT_DEVICE) {
+                if (d.metrics_clients[data - DAEMON_EVENT_METRICS_CLIENT].fd >= 0) {
+                    daemon_metrics_read(&d, data - DAEMON_EVENT_METRICS_CLIENT);
+                }
+            } else if (data == DAEMON_EVENT_METRICS_TIMER) {
+                uint64_t expirations;
+                if (read(metrics_timer, &expirations, sizeof(expirations)) > 0) {
+                    daemon_write_metrics_file(&d);
+                }
+            } else if (d.devices[data - DAEMON_EVENT_DEVICE].active) {
+                daemon_read_input(&d, &d.devices[data - DAEMON_EVENT_DEVICE]);
+            }
         }
-        if (!strcmp(udev_device_get_action(dev), "add")) {
-            add_device(dev);
-        } else if (!strcmp(udev_device_get_action(dev), "remove")) {
-            remove_device(dev);
+    }
+
+    for (int i = 0; i < DAEMON_MAX_DEVICES; ++i) {
+        if (d.devices[i].active) {
+            daemon_remove_device(&d, &d.devices[i]);
         }
-        udev_device_unref(dev);
     }
+    if (d.monitor) {
+        udev_monitor_unref(d.monitor);
+    }
+    for (int i = 0; i < DAEMON_METRICS_CLIENTS; ++i) {
+        if (d.metrics_clients[i].fd >= 0) {
+            daemon_metrics_close(&d, i);
+        }
+    }
+    if (d.metrics_fd >= 0) {
+        close(d.metrics_fd);
+    }
+    if (metrics_timer >= 0) {
+        close(metrics_timer);
+    }
+    if (u) {
+        udev_unref(u);
+    }
+    close(d.epoll_fd);
+    close(fd);
+    unlink(addr.sun_path);
 
-    udev_monitor_unref(monitor);
-    udev_unref(u);
+    return ret;
+}
 
-    return 0;
+static int client_run_command(const char *serial, int argc, char *argv[])
+{
+    char buf[DAEMON_MAX_REQUEST];
+    size_t len = 0;
+    for (int i = -1; i < argc; ++i) {
+        const char *arg = i < 0 ? (serial ? serial : "") : argv[i];
+        size_t arglen = strlen(arg) + 1;
+        if (len + arglen > sizeof(buf) - 1) {
+            fprintf(stderr, "Arguments too long\n");
+            return 2;
+        }
+        memcpy(buf + len, arg, arglen);
+        len += arglen;
+    }
+
+    struct sockaddr_un addr;
+    if (!daemon_socket_address(&addr)) {
+        return 1;
+    }
+    int fd = daemon_connect(&addr);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to connect to daemon: %s\n", strerror(errno));
+        return 1;
+    }
+
+    int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cmsg;
+    memset(&cmsg, 0, sizeof(cmsg));
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    fflush(stdout);
+    fflush(stderr);
+
+    int32_t ret = 1;
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+        perror("sendmsg");
+    } else if (recv(fd, &ret, sizeof(ret), 0) != sizeof(ret)) {
+        fprintf(stderr, "No reply from daemon\n");
+        ret = 1;
+    }
+    close(fd);
+    return ret;
 }
 
 static void print_help(void)
 {
-    printf("Usage: dualsensectl [options] command [ARGS]\n");
+    printf("Usage: dualsensectl [options] command [ARGS] [+ command [ARGS]]...\n");
     printf("\n");
     printf("Options:\n");
     printf("  -l                                       List available devices\n");
-    printf("  -d DEVICE                                Specify which device to use\n");
-    printf("  -w                                       Wait for shell command to complete (monitor only)\n");
+    printf("  -d DEVICE                                Specify which device to use, 'all' or a comma separated list\n");
+    printf("  -w                                       Run monitor commands one at a time, same as -j 1\n");
+    printf("  -c                                       Send command to a running daemon\n");
+    printf("  -r RATE                                  Limit output reports per second (default 250 on BT, 0 for no limit)\n");
     printf("  -h --help                                Show this help message\n");
     printf("  -v --version                             Show version\n");
-    printf("Commands:\n");
+    printf("Commands (join with + to send them in one report):\n");
     printf("  power-off                                Turn off the controller (BT only)\n");
     printf("  battery                                  Get the controller battery level\n");
+    printf("  battery --all [--json] [--max-age SECONDS]\n\
+                                           Get the battery level of all controllers, reusing results up to SECONDS old\n");
     printf("  info                                     Get the controller firmware info\n");
+    printf("  stream [FORMAT]                          Print all input reports as 'json' lines or 'binary' records\n");
+    printf("  record FILE                              Record all input reports to FILE\n");
+    printf("  replay [--uhid] FILE [FROM]              Print reports recorded in FILE starting at FROM seconds as json,\n\
+                                           or play them back through a virtual uhid controller\n");
     printf("  lightbar STATE                           Enable (on) or disable (off) lightbar\n");
     printf("  lightbar RED GREEN BLUE [BRIGHTNESS]     Set lightbar color and brightness (0-255)\n");
+    printf("  animate [-f FPS] [-t SECONDS] EFFECT     Animate the lightbar at FPS (default 60, max 250) for SECONDS:\n\
+                                           rainbow [PERIOD], breathe RED GREEN BLUE [PERIOD],\n\
+                                           fade RED GREEN BLUE RED GREEN BLUE [TIME] or keyframes FILE\n");
+    printf("  profile apply FILE [NAME]                Send profile NAME (default the first) of a compiled FILE\n");
+    printf("  profile compile INI FILE                 Compile the profiles in INI to FILE (no device needed)\n");
     printf("  led-brightness NUMBER                    Set player and microphone LED dimming (0-2)\n");
     printf("  player-leds NUMBER [instant]             Set player LEDs (1-7) or disabled (0)\n");
     printf("  microphone STATE                         Enable (on) or disable (off) microphone\n");
     printf("  microphone-led STATE                     Enable (on), disable (off) or pulsate (pulse) microphone LED\n");
     printf("  microphone-mode STATE                    Toggle microphone usage to 'chat', 'asr' or 'both'\n");
     printf("  speaker STATE                            Toggle to 'internal' speaker, 'headphone' or 'both'\n");
-    printf("  volume VOLUME                            Set audio volume (0-255) of internal speaker and headphone\n");
-    printf("  attenuation RUMBLE TRIGGER               Set the attenuation (0-7) of rumble/haptic motors and trigger vibration\n");
+    printf("  volume VOLUME [OUTPUT]                   Set audio volume (0-255) of 'headphone', 'speaker' or both\n");
+    printf("  attenuation RUMBLE TRIGGER               Set the attenuation (0-7, - to keep) of rumble/haptic motors and trigger vibration\n");
     printf("  trigger TRIGGER off                      remove all effects\n");
     printf("  trigger TRIGGER feedback POSITION STRENGTH\n\
                                            set a resistance starting at position with a defined strength\n");
@@ -1268,7 +5691,21 @@ static void print_help(void)
     printf("  trigger TRIGGER vibration-raw AMPLITUDE[10] FREQUENCY\n\
                                            Vibrates motor arm at position and strength specified by an array of amplitude\n");
     printf("  trigger TRIGGER MODE [PARAMS]            set the trigger (left, right or both) mode with parameters (up to 9)\n");
-    printf("  monitor [add COMMAND] [remove COMMAND]   Run shell command COMMAND on add/remove events\n");
+    printf("  trigger TRIGGER effect LIBRARY EFFECT    Set the trigger to EFFECT (name or index) of a compiled LIBRARY\n");
+    printf("  sequence [-n LOOPS] FILE                 Play the timeline of trigger effects in FILE LOOPS times (0 forever)\n");
+    printf("  effects compile FILE LIBRARY             Compile the NAME MODE [PARAMS] lines in FILE to LIBRARY (no device needed)\n");
+    printf("  effects list LIBRARY                     List the effects in LIBRARY with index and packed bytes\n");
+    printf("  monitor [-j JOBS] [-t MS] [--exec] [--apply-profile FILE] [add COMMAND] [remove COMMAND] [reconnect COMMAND]\n\
+                                           Run shell command COMMAND on add/remove events, at most\n\
+                                           JOBS (default 4) at a time, --exec runs it without a shell.\n\
+                                           Events within MS (default 500) are merged, a remove and add\n\
+                                           runs reconnect (default add). Commands in FILE, one per line,\n\
+                                           are applied to each connected controller directly\n");
+    printf("  daemon [-r RATE] [--metrics-file FILE] [--metrics-port PORT] [--metrics-address ADDRESS]\n\
+                                           Keep devices open and run commands sent with -c,\n\
+                                           export metrics to FILE or over HTTP on PORT at ADDRESS\n\
+                                           (default 127.0.0.1)\n");
+    printf("  mock [usb|bt] [MAC]                      Create a virtual controller through uhid until interrupted\n");
 }
 
 static void print_version(void)
@@ -1278,17 +5715,18 @@ static void print_version(void)
 
 static int list_devices(void)
 {
-    struct hid_device_info *devs = dualsense_hid_enumerate();
+    struct dualsense_device_info *devs = dualsense_enumerate(dualsense_transport());
     if (!devs) {
         fprintf(stderr, "No devices found\n");
         return 1;
     }
     printf("Devices:\n");
-    struct hid_device_info *dev = devs;
+    struct dualsense_device_info *dev = devs;
     while (dev) {
-        printf(" %ls (%s)\n", dev->serial_number ? dev->serial_number : L"???", dev->interface_number == -1 ? "Bluetooth" : "USB");
+        printf(" %s (%s)\n", dev->serial[0] ? dev->serial : "???", dev->bt ? "Bluetooth" : "USB");
         dev = dev->next;
     }
+    dualsense_free_enumeration(devs);
     return 0;
 }
 
@@ -1309,12 +5747,79 @@ int main(int argc, char *argv[])
         return 0;
     } else if (!strcmp(argv[1], "-l")) {
         return list_devices();
+    } else if (!strcmp(argv[1], "replay")) {
+        bool uhid = argc > 2 && !strcmp(argv[2], "--uhid");
+        if (uhid) {
+            argc -= 1;
+            argv += 1;
+        }
+        if (argc != 3 && argc != 4) {
+            print_help();
+            return 1;
+        }
+        double from = 0;
+        if (argc == 4) {
+            char *end;
+            from = strtod(argv[3], &end);
+            /* Recording timestamps are uint64_t ns, about 584 years */
+            if (*end || !(from >= 0 && from < 1e10)) {
+                fprintf(stderr, "Invalid argument: FROM must be a number of seconds\n");
+                return 1;
+            }
+        }
+        return uhid ? command_replay_uhid(argv[2], from) : command_replay(argv[2], from);
+    } else if (argc > 2 && !strcmp(argv[1], "effects") && !strcmp(argv[2], "compile")) {
+        if (argc != 5) {
+            print_help();
+            return 1;
+        }
+        return command_effects_compile(argv[3], argv[4]);
+    } else if (argc > 2 && !strcmp(argv[1], "effects") && !strcmp(argv[2], "list")) {
+        if (argc != 4) {
+            print_help();
+            return 1;
+        }
+        return command_effects_list(argv[3]);
+    } else if (argc > 2 && !strcmp(argv[1], "profile") && !strcmp(argv[2], "compile")) {
+        if (argc != 5) {
+            print_help();
+            return 1;
+        }
+        return command_profile_compile(argv[3], argv[4]);
+    } else if (!strcmp(argv[1], "mock")) {
+        if (argc > 4 || (argc > 2 && strcmp(argv[2], "usb") && strcmp(argv[2], "bt"))) {
+            print_help();
+            return 1;
+        }
+        return command_mock(argc > 2 && !strcmp(argv[2], "bt"), argc > 3 ? argv[3] : "00:11:22:33:44:55");
     } else if (!strcmp(argv[1], "monitor")) {
         argc -= 2;
         argv += 2;
         while (argc) {
             if (!strcmp(argv[0], "-w")) {
                 sh_command_wait = true;
+            } else if (!strcmp(argv[0], "--exec")) {
+                sh_command_exec = true;
+            } else if (!strcmp(argv[0], "--apply-profile")) {
+                static struct monitor_profile profile;
+                if (argc < 2) {
+                    print_help();
+                    return 1;
+                }
+                if (!monitor_profile_load(&profile, argv[1])) {
+                    return 1;
+                }
+                monitor_profile = &profile;
+                argc -= 1;
+                argv += 1;
+            } else if (!strcmp(argv[0], "-j")) {
+                if (argc < 2 || atoi_x(argv[1]) < 1) {
+                    print_help();
+                    return 1;
+                }
+                sh_command_jobs = atoi_x(argv[1]);
+                argc -= 1;
+                argv += 1;
             } else if (!strcmp(argv[0], "add")) {
                 if (argc < 2) {
                     print_help();
@@ -1331,19 +5836,73 @@ int main(int argc, char *argv[])
                 sh_command_remove = argv[1];
                 argc -= 1;
                 argv += 1;
+            } else if (!strcmp(argv[0], "reconnect")) {
+                if (argc < 2) {
+                    print_help();
+                    return 1;
+                }
+                sh_command_reconnect = argv[1];
+                argc -= 1;
+                argv += 1;
+            } else if (!strcmp(argv[0], "-t")) {
+                if (argc < 2) {
+                    print_help();
+                    return 1;
+                }
+                monitor_debounce_ms = atoi_x(argv[1]);
+                argc -= 1;
+                argv += 1;
             }
             argc -= 1;
             argv += 1;
         }
         return command_monitor();
-    } else if (!strcmp(argv[1], "-d")) {
-        if (argc < 3) {
-            print_help();
-            return 1;
+    } else if (!strcmp(argv[1], "daemon")) {
+        for (int i = 2; i < argc; i += 2) {
+            if (i + 1 == argc) {
+                print_help();
+                return 1;
+            } else if (!strcmp(argv[i], "-r")) {
+                output_rate = atoi_x(argv[i + 1]);
+            } else if (!strcmp(argv[i], "--metrics-file")) {
+                metrics_file = argv[i + 1];
+            } else if (!strcmp(argv[i], "--metrics-port")) {
+                metrics_port = atoi_x(argv[i + 1]);
+            } else if (!strcmp(argv[i], "--metrics-address")) {
+                metrics_address = argv[i + 1];
+            } else {
+                print_help();
+                return 1;
+            }
+        }
+        return command_daemon();
+    }
+
+    bool client = false;
+    while (argc > 1 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-d")) {
+            if (argc < 3) {
+                print_help();
+                return 1;
+            }
+            dev_serial = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else if (!strcmp(argv[1], "-c")) {
+            client = true;
+            argc -= 1;
+            argv += 1;
+        } else if (!strcmp(argv[1], "-r")) {
+            if (argc < 3) {
+                print_help();
+                return 1;
+            }
+            output_rate = atoi_x(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else {
+            break;
         }
-        dev_serial = argv[2];
-        argc -= 2;
-        argv += 2;
     }
 
     if (argc < 2) {
@@ -1351,168 +5910,26 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (client) {
+        return client_run_command(dev_serial, argc - 1, argv + 1);
+    }
+
+    bool json;
+    double max_age;
+    if (parse_battery_all(argc - 1, argv + 1, &json, &max_age)) {
+        return command_battery_all(json, max_age);
+    }
+
+    if (dev_serial && (!strcmp(dev_serial, "all") || strchr(dev_serial, ','))) {
+        return run_command_multi(dev_serial, argc - 1, argv + 1);
+    }
+
     struct dualsense ds;
     if (!dualsense_init(&ds, dev_serial)) {
         return 1;
     }
 
-    if (!strcmp(argv[1], "power-off")) {
-        return command_power_off(&ds);
-    } else if (!strcmp(argv[1], "battery")) {
-        return command_battery(&ds);
-    } else if (!strcmp(argv[1], "info")) {
-        return command_info(&ds);
-    } else if (!strcmp(argv[1], "lightbar")) {
-        if (argc == 3) {
-            return command_lightbar1(&ds, argv[2]);
-        } else if (argc == 5 || argc == 6) {
-            uint8_t brightness = argc == 6 ? atoi_x(argv[5]) : 255;
-            return command_lightbar3(&ds, atoi_x(argv[2]), atoi_x(argv[3]), atoi_x(argv[4]), brightness);
-        } else {
-            fprintf(stderr, "Invalid arguments\n");
-            return 2;
-        }
-    } else if (!strcmp(argv[1], "led-brightness")) {
-        if (argc != 3) {
-            fprintf(stderr, "Invalid arguments\n");
-            return 2;
-        }
-        return command_led_brightness(&ds, atoi_x(argv[2]));
-    } else if (!strcmp(argv[1], "player-leds")) {
-        bool instant;
-        if (argc == 3) {
-            instant = false;
-        } else if (argc == 4) {
-            instant = !strcmp(argv[3], "instant");
-        } else {
-            fprintf(stderr, "Invalid arguments\n");
-            return 2;
-        }
-        return command_player_leds(&ds, atoi_x(argv[2]), instant);
-    } else if (!strcmp(argv[1], "microphone")) {
-        if (argc != 3) {
-            fprintf(stderr, "Invalid arguments\n");
-            return 2;
-        }
-        return command_microphone(&ds, argv[2]);
-    } else if (!strcmp(argv[1], "microphone-led")) {
-        if (argc != 3) {
-            fprintf(stderr, "Invalid arguments\n");
-            return 2;
-        }
-        return command_microphone_led(&ds, argv[2]);
-    } else if (!strcmp(argv[1], "microphone-mode")) {
-        if (argc != 3) {
-            fprintf(stderr, "Invalid arguments\n");
-            return 2;
-        }
-        return command_microphone_mode(&ds, argv[2]);
-    } else if (!strcmp(argv[1], "speaker")) {
-        if (argc != 3) {
-            fprintf(stderr, "Invalid arguments\n");
-            return 2;
-        }
-        return command_speaker(&ds, argv[2]);
-    } else if (!strcmp(argv[1], "volume")) {
-        if (argc != 3) {
-            fprintf(stderr, "Invalid arguments\n");
-            return 2;
-        }
-        if (atoi_x(argv[2]) > 255) {
-            fprintf(stderr, "Invalid volume\n");
-            return 1;
-        }
-        return command_volume(&ds, atoi_x(argv[2]));
-    } else if (!strcmp(argv[1], "attenuation")) {
-        if (argc != 4) {
-            fprintf(stderr, "Invalid arguments\n");
-            return 2;
-        }
-        if ((atoi_x(argv[2]) > 7) | (atoi_x(argv[3]) > 7)) {
-            fprintf(stderr, "Invalid attenuation\n");
-            return 1;
-        }
-        return command_vibration_attenuation(&ds, atoi_x(argv[2]), atoi_x(argv[3]));
-    } else if (!strcmp(argv[1], "trigger")) {
-        if (argc < 4) {
-            fprintf(stderr, "Invalid arguments\n");
-            return 2;
-        }
-        if (strcmp(argv[2], "left") && strcmp(argv[2], "right") && strcmp(argv[2], "both")) {
-            fprintf(stderr, "Invalid argument: TRIGGER must be either \"left\", \"right\" or \"both\"\n");
-            return 2;
-        }
-        if (!strcmp(argv[3], "off")) {
-            return command_trigger_off(&ds, argv[2]);
-        } else if (!strcmp(argv[3], "feedback")) {
-            if (argc < 6) {
-                fprintf(stderr, "feedback mode need two parameters\n");
-                return 2;
-            }
-            return command_trigger_feedback(&ds, argv[2], atoi_x(argv[4]), atoi_x(argv[5]));
-        } else if (!strcmp(argv[3], "weapon")) {
-            if (argc < 7) {
-                fprintf(stderr, "weapons mode need three parameters\n");
-                return 2;
-            }
-            return command_trigger_weapon(&ds, argv[2], atoi_x(argv[4]), atoi_x(argv[5]), atoi_x(argv[6]));
-        } else if (!strcmp(argv[3], "bow")) {
-            if (argc < 8) {
-                fprintf(stderr, "bow mode need four parameters\n");
-                return 2;
-            }
-            return command_trigger_bow(&ds, argv[2], atoi_x(argv[4]), atoi_x(argv[5]), atoi_x(argv[6]), atoi_x(argv[7]));
-        } else if (!strcmp(argv[3], "galloping")) {
-            if (argc < 9) {
-                fprintf(stderr, "galloping mode need five parameters\n");
-                return 2;
-            }
-            return command_trigger_galloping(&ds, argv[2], atoi_x(argv[4]), atoi_x(argv[5]), atoi_x(argv[6]), atoi_x(argv[7]), atoi_x(argv[8]));
-        } else if (!strcmp(argv[3], "machine")) {
-            if (argc < 10) {
-                fprintf(stderr, "machine mode need six parameters\n");
-                return 2;
-            }
-            return command_trigger_machine(&ds, argv[2], atoi_x(argv[4]), atoi_x(argv[5]), atoi_x(argv[6]), atoi_x(argv[7]), atoi_x(argv[8]), atoi_x(argv[9]));
-        } else if (!strcmp(argv[3], "vibration")) {
-            if (argc < 7) {
-                fprintf(stderr, "vibration mode need three parameters\n");
-                return 2;
-            }
-            return command_trigger_vibration(&ds, argv[2], atoi_x(argv[4]), atoi_x(argv[5]), atoi_x(argv[6]));
-        } else if (!strcmp(argv[3], "feedback-raw")) {
-            if (argc < 14) {
-                fprintf(stderr, "feedback-raw mode need ten parameters\n");
-                return 2;
-            }
-            uint8_t strengths[10] = { atoi_x(argv[4]), atoi_x(argv[5]), atoi_x(argv[6]), atoi_x(argv[7]), atoi_x(argv[8]), atoi_x(argv[9]), atoi_x(argv[10]), atoi_x(argv[11]), atoi_x(argv[12]), atoi_x(argv[13]) };
-            return command_trigger_feedback_raw(&ds, argv[2], strengths);
-        } else if (!strcmp(argv[3], "vibration-raw")) {
-            if (argc < 15) {
-                fprintf(stderr, "vibration-raw mode need eleven parameters\n");
-                return 2;
-            }
-            uint8_t strengths[10] = { atoi_x(argv[4]), atoi_x(argv[5]), atoi_x(argv[6]), atoi_x(argv[7]), atoi_x(argv[8]), atoi_x(argv[9]), atoi_x(argv[10]), atoi_x(argv[11]), atoi_x(argv[12]), atoi_x(argv[13]) };
-            return command_trigger_vibration_raw(&ds, argv[2], strengths, atoi_x(argv[14]));
-        }
-
-        /* mostly to test raw parameters without any kind of bitpacking or range check */
-        uint8_t param1 = argc > 4 ? atoi_x(argv[4]) : 0;
-        uint8_t param2 = argc > 5 ? atoi_x(argv[5]) : 0;
-        uint8_t param3 = argc > 6 ? atoi_x(argv[6]) : 0;
-        uint8_t param4 = argc > 7 ? atoi_x(argv[7]) : 0;
-        uint8_t param5 = argc > 8 ? atoi_x(argv[8]) : 0;
-        uint8_t param6 = argc > 9 ? atoi_x(argv[9]) : 0;
-        uint8_t param7 = argc > 10 ? atoi_x(argv[10]) : 0;
-        uint8_t param8 = argc > 11 ? atoi_x(argv[11]) : 0;
-        uint8_t param9 = argc > 12 ? atoi_x(argv[12]) : 0;
-
-        return command_trigger(&ds, argv[2], atoi_x(argv[3]), param1, param2, param3, param4, param5, param6, param7, param8, param9);
-    } else {
-        fprintf(stderr, "Invalid command\n");
-        return 2;
-    }
-
+    int ret = run_command(&ds, argc - 1, argv + 1);
     dualsense_destroy(&ds);
-    return 0;
+    return ret;
 }